@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "rlib.h"
+
+/* Add len bytes at src to the partial sum, copying them to dst on the
+ * way if dst is not NULL.  Eight bytes at a time, as two 32-bit words
+ * added up in 64 bits: the carries are folded back in at the end. */
+static inline uint32_t
+cksum_run (uint32_t sum, uint8_t *dst, const uint8_t *src, int len)
+{
+  uint64_t acc = sum, w;
+
+  for (; len >= 8; src += 8, len -= 8) {
+    memcpy (&w, src, 8);
+    if (dst) {
+      memcpy (dst, &w, 8);
+      dst += 8;
+    }
+    acc += (uint32_t) w;
+    acc += w >> 32;
+  }
+  if (len > 0) {
+    w = 0;
+    memcpy (&w, src, len);
+    if (dst)
+      memcpy (dst, src, len);
+    acc += (uint32_t) w;
+    acc += w >> 32;
+  }
+  while (acc >> 32)
+    acc = (acc & 0xffffffff) + (acc >> 32);
+  return acc;
+}
+
+uint32_t
+cksum_add (uint32_t sum, const void *data, int len)
+{
+  return cksum_run (sum, NULL, data, len);
+}
+
+uint32_t
+cksum_copy (uint32_t sum, void *dst, const void *src, int len)
+{
+  return cksum_run (sum, dst, src, len);
+}
+
+uint16_t
+cksum_fold (uint32_t sum)
+{
+  sum = (sum >> 16) + (sum & 0xffff);
+  sum = (sum >> 16) + (sum & 0xffff);
+  /* Summed in host order, the complement is in network order already
+   * (RFC 1071, 2.B) */
+  sum = (uint16_t) ~sum;
+  return sum ? sum : 0xffff;
+}
+
+uint16_t
+cksum (const void *_data, int len)
+{
+  return cksum_fold (cksum_add (0, _data, len));
+}
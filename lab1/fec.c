@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "fec.h"
+
+/* XOR one member, taken as [16-bit length][payload], into acc.  The
+ * length goes in with FEC_MARK, if set. */
+static void
+fec_xor (uint8_t *acc, size_t *acclen, const void *_data, size_t len)
+{
+  const uint8_t *data = _data;
+  size_t i, n = len & ~FEC_MARK;
+
+  acc[0] ^= len >> 8;
+  acc[1] ^= len & 0xff;
+  for (i = 0; i < n; i++)
+    acc[2 + i] ^= data[i];
+  if (2 + n > *acclen)
+    *acclen = 2 + n;
+}
+
+void
+fec_encoder_start (struct fec_encoder *e, uint64_t base)
+{
+  e->base = base;
+  e->count = 0;
+  e->acclen = 2;
+  memset (e->acc, 0, sizeof (e->acc));
+}
+
+int
+fec_encoder_add (struct fec_encoder *e, const void *data, size_t len)
+{
+  fec_xor (e->acc, &e->acclen, data, len);
+  return e->count++;
+}
+
+static struct fec_group *
+fec_group_get (struct fec_decoder *d, uint64_t base)
+{
+  struct fec_group *g, *victim = NULL;
+
+  for (g = d->group; g < d->group + FEC_MAX_GROUPS; g++) {
+    if (g->active && g->base == base)
+      return g;
+    if (!g->active)
+      victim = g;
+  }
+
+  /* All slots busy: the oldest group is the least likely to be
+   * completed, so give it up. */
+  if (!victim)
+    for (victim = g = d->group; g < d->group + FEC_MAX_GROUPS; g++)
+      if (g->base < victim->base)
+	victim = g;
+
+  memset (victim, 0, offsetof (struct fec_group, acc));
+  victim->active = 1;
+  victim->base = base;
+  victim->acclen = 2;
+  memset (victim->acc, 0, sizeof (victim->acc));
+  return victim;
+}
+
+/* If exactly one member of g is missing, what is left in acc is that
+ * member. */
+static int
+fec_group_recover (struct fec_group *g, struct fec_lost *lost)
+{
+  int i;
+  size_t len, n;
+
+  if (!g->parity || g->nseen != g->count - 1)
+    return 0;
+
+  for (i = 0; i < g->count; i++)
+    if (!(g->seen & (1U << i)))
+      break;
+  len = g->acc[0] << 8 | g->acc[1];
+  n = len & ~FEC_MARK;
+  if (n > FEC_MAX_PAYLOAD || 2 + n > g->acclen) {
+    g->active = 0;
+    return -1;
+  }
+
+  lost->seqno = g->base + i;
+  lost->len = len;
+  memcpy (lost->data, g->acc + 2, n);
+  g->seen |= 1U << i;
+  g->nseen++;
+  return 1;
+}
+
+int
+fec_decoder_member (struct fec_decoder *d, uint64_t seqno, int index,
+		    const void *data, size_t len, struct fec_lost *lost)
+{
+  struct fec_group *g;
+
+  if (index < 0 || index >= FEC_MAX_K || (uint64_t) index > seqno
+      || (len & ~FEC_MARK) > FEC_MAX_PAYLOAD)
+    return 0;
+
+  g = fec_group_get (d, seqno - index);
+  if (g->seen & (1U << index))
+    return 0;
+  if (g->parity && index >= g->count)
+    return 0;
+  g->seen |= 1U << index;
+  g->nseen++;
+  fec_xor (g->acc, &g->acclen, data, len);
+  return fec_group_recover (g, lost);
+}
+
+int
+fec_decoder_parity (struct fec_decoder *d, uint64_t base, int count,
+		    const void *_data, size_t len, struct fec_lost *lost)
+{
+  const uint8_t *data = _data;
+  struct fec_group *g;
+  size_t i;
+
+  if (count < 1 || count > FEC_MAX_K || len < 2 || len > FEC_PARITY_MAX)
+    return 0;
+
+  g = fec_group_get (d, base);
+  if (g->parity)
+    return 0;
+  if (count < FEC_MAX_K && (g->seen >> count)) { /* members past the end */
+    g->active = 0;
+    return -1;
+  }
+  g->parity = 1;
+  g->count = count;
+  for (i = 0; i < len; i++)
+    g->acc[i] ^= data[i];
+  if (len > g->acclen)
+    g->acclen = len;
+  return fec_group_recover (g, lost);
+}
+
+int
+fec_decoder_retire (struct fec_decoder *d, uint64_t delivered)
+{
+  struct fec_group *g;
+  int n = 0;
+
+  for (g = d->group; g < d->group + FEC_MAX_GROUPS; g++) {
+    if (!g->active)
+      continue;
+    /* Until the parity says how big the group is, it could still have
+     * members up to FEC_MAX_K - 1 past its base. */
+    if ((g->count && g->base + g->count - 1 <= delivered)
+	|| g->base + FEC_MAX_K - 1 <= delivered)
+      g->active = 0;
+    else
+      n++;
+  }
+  return n;
+}
+
+int
+fec_choose_k (uint32_t lossrate)
+{
+  /* Aim at a quarter of a loss per group, so that two losses in one
+   * group (which parity cannot repair) stay rare. */
+  uint32_t k;
+
+  if (lossrate == 0)
+    return FEC_MAX_K;
+  k = FEC_LOSS_ONE / (4 * lossrate);
+  if (k < FEC_MIN_K)
+    return FEC_MIN_K;
+  if (k > FEC_MAX_K)
+    return FEC_MAX_K;
+  return k;
+}
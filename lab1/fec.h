@@ -0,0 +1,96 @@
+/* XOR-parity forward error correction for the reliable transport.
+
+   The sender splits its stream of Data packets into groups of K
+   consecutive sequence numbers.  After the last member of a group it
+   emits one parity packet whose payload is the XOR of all members,
+   each member being taken as its 16-bit payload length followed by
+   its payload:
+
+     parity = XOR over i of  [ len_i ][ payload_i ][ zero padding ]
+
+   A receiver that has the parity and all but one member of a group can
+   XOR them together and is left with the length and payload of the
+   missing member, without waiting for a retransmission.
+
+   K adapts to the loss rate seen by the sender: one parity per group
+   only helps when a group rarely loses more than one packet, so the
+   groups shrink as losses grow (see fec_choose_k).
+
+   The functions here only deal with payloads and sequence numbers;
+   how members and parity packets are marked on the wire is up to
+   reliable.c. */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FEC_MIN_K        2
+#define FEC_MAX_K        32	/* members of a group must fit a uint32_t mask */
+#define FEC_MAX_GROUPS   8	/* groups a receiver tracks at once */
+#define FEC_MAX_PAYLOAD  500
+#define FEC_PARITY_MAX   (2 + FEC_MAX_PAYLOAD)
+
+/* May be or'ed into the len of a member, to tell the receiver
+ * something about its payload; comes back in fec_lost.len. */
+#define FEC_MARK         0x8000
+
+/* Loss rates are fractions scaled by FEC_LOSS_ONE. */
+#define FEC_LOSS_ONE     65536
+
+struct fec_encoder {
+  uint64_t base;		/* seqno of the first member */
+  int count;			/* members added so far */
+  size_t acclen;		/* bytes of acc in use */
+  uint8_t acc[FEC_PARITY_MAX];	/* running parity */
+};
+
+struct fec_group {
+  uint64_t base;		/* seqno of the first member */
+  int count;			/* group size, 0 until the parity is seen */
+  int active;
+  int nseen;			/* members accounted for in acc */
+  uint32_t seen;		/* bitmask of those members */
+  int parity;			/* parity accounted for in acc */
+  size_t acclen;
+  uint8_t acc[FEC_PARITY_MAX];
+};
+
+struct fec_decoder {
+  struct fec_group group[FEC_MAX_GROUPS];
+};
+
+/* A member rebuilt from the parity of its group. */
+struct fec_lost {
+  uint64_t seqno;
+  size_t len;
+  uint8_t data[FEC_MAX_PAYLOAD];
+};
+
+/* Start a new group whose first member will be seqno base. */
+void fec_encoder_start (struct fec_encoder *e, uint64_t base);
+
+/* Fold the payload of the next member into the parity.  Returns the
+ * index of the member within its group. */
+int fec_encoder_add (struct fec_encoder *e, const void *data, size_t len);
+
+/* Account for a member (index within the group starting at seqno -
+ * index) or for the parity of a group of count members.  When that
+ * leaves exactly one member missing, rebuilds it into *lost and
+ * returns 1; otherwise returns 0.  Returns -1 if the parity is
+ * inconsistent with what was received, e.g. a bogus length. */
+int fec_decoder_member (struct fec_decoder *d, uint64_t seqno, int index,
+			const void *data, size_t len, struct fec_lost *lost);
+int fec_decoder_parity (struct fec_decoder *d, uint64_t base, int count,
+			const void *data, size_t len, struct fec_lost *lost);
+
+/* Forget groups that cannot help anymore, now that every seqno up to
+ * and including delivered has been handed to the application.
+ * Returns the number of groups still being tracked. */
+int fec_decoder_retire (struct fec_decoder *d, uint64_t delivered);
+
+/* Group size to use for a given loss rate. */
+int fec_choose_k (uint32_t lossrate);
+
+#endif /* FEC_H */
@@ -0,0 +1,65 @@
+/* The transport as a library (make librel.a librel.so), for programs
+ * that open reliable connections themselves instead of running
+ * reliable.  Connections belong to an event loop, which the program
+ * drives with rel_loop_poll.  rlib and reliable keep their state per
+ * thread: each thread may have one loop, and a loop and its
+ * connections may only be used from the thread that created it.
+ * Several threads may run loops of their own side by side.
+ *
+ * The application end of a connection is a stream socket.  What is
+ * written to it goes to the peer, what the peer sends can be read
+ * from it, and shutdown (fd, SHUT_WR) sends an EOF.  When the
+ * connection is over, the library closes its end. */
+
+#ifndef LIBREL_H
+#define LIBREL_H
+
+#include "rlib.h"
+
+typedef struct rel_loop rel_loop_t;
+
+struct rel_loop_options {
+  size_t membudget;		/* buffer memory of all connections (-G),
+				   0 for the default */
+  int sched_budget;		/* Data packets per round shared out by
+				   weight (-Q), 0 to send at will */
+  int mux;			/* streams of one session (-X), server only */
+  int nooffload;		/* no UDP segmentation offload (-O) */
+};
+
+/* Create the loop of the calling thread.  cc is copied, and timer
+ * defaults to timeout / 5; opts may be NULL.  Returns NULL if the
+ * thread already has a loop (errno EBUSY) or the configuration makes
+ * no sense (EINVAL). */
+rel_loop_t *rel_loop_new (const struct config_common *cc,
+			  const struct rel_loop_options *opts);
+
+/* Tear down every connection of l at once and free it. */
+void rel_loop_free (rel_loop_t *l);
+
+/* Wait for events, at most until the next timer tick, and handle
+ * them.  Returns the number of connections left. */
+int rel_loop_poll (rel_loop_t *l);
+
+/* Weight and priority, with a scheduling budget, of the connections
+ * with peers matching addr; port 0 matches any port.  The first rule
+ * that matches a new connection applies.  Returns -1 when there are
+ * too many rules. */
+int rel_loop_weight (rel_loop_t *l, const struct sockaddr_storage *addr,
+		     int weight, int prio);
+
+/* Open a connection from UDP port local to remote ("port" or
+ * "host:port"), like reliable stand-alone.  Returns the application
+ * end, or -1. */
+int rel_connect (rel_loop_t *l, const char *local, const char *remote);
+
+/* Accept connections on UDP port local, like reliable -s.  fn gets the
+ * application end of each new connection and the address of its peer;
+ * when fn returns -1, the connection is refused and fd closed.
+ * Returns -1 if the port cannot be had. */
+typedef int rel_accept_fn (int fd, const struct sockaddr_storage *peer,
+			   void *arg);
+int rel_listen (rel_loop_t *l, const char *local, rel_accept_fn *fn,
+		void *arg);
+
+#endif /* LIBREL_H */
@@ -0,0 +1,479 @@
+/* C++20 coroutines over librel (header only; link with librel.a or
+ * librel.so).
+
+   A rel::loop owns the rlib loop of its thread and runs the coroutines
+   spawned on it.  Coroutines are rel::task, and wait for the transport
+   with co_await:
+
+     rel::task echo (rel::connection c)
+     {
+       rel::buffer buf (4096);
+       while (co_await c.read (buf))
+         co_await c.write (buf);
+     }
+
+     rel::task serve (rel::loop &lp)
+     {
+       rel::listener l (lp, "6000");
+       for (;;)
+         lp.spawn (echo (co_await l.accept ()));
+     }
+
+     rel::loop lp (cc);
+     lp.spawn (serve (lp));
+     lp.run ();
+
+   Connections are the application ends of librel connections, and
+   close when their rel::connection goes away.  read and write move
+   bytes straight between the caller's memory and the transport's
+   socket, never through buffers of their own.  Errors are thrown as
+   std::system_error. */
+
+#ifndef LIBREL_HH
+#define LIBREL_HH
+
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C" {
+#include "librel.h"
+}
+
+namespace rel {
+
+class loop;
+class connection;
+
+[[noreturn]] inline void
+throw_errno (const char *what, int err = errno)
+{
+  throw std::system_error (err, std::generic_category (), what);
+}
+
+/* Owned bytes, move-only: size () bytes of data in room for
+ * capacity () */
+class buffer {
+public:
+  explicit buffer (std::size_t capacity)
+    : data_ (new std::byte[capacity]), size_ (0), capacity_ (capacity) {}
+  buffer (buffer &&b) noexcept
+    : data_ (std::move (b.data_)), size_ (std::exchange (b.size_, 0)),
+      capacity_ (std::exchange (b.capacity_, 0)) {}
+  buffer &operator= (buffer &&b) noexcept
+  {
+    data_ = std::move (b.data_);
+    size_ = std::exchange (b.size_, 0);
+    capacity_ = std::exchange (b.capacity_, 0);
+    return *this;
+  }
+
+  std::byte *data () { return data_.get (); }
+  const std::byte *data () const { return data_.get (); }
+  std::size_t size () const { return size_; }
+  std::size_t capacity () const { return capacity_; }
+  void resize (std::size_t n) { size_ = n < capacity_ ? n : capacity_; }
+  std::span<std::byte> room () { return { data_.get (), capacity_ }; }
+  operator std::span<const std::byte> () const
+  {
+    return { data_.get (), size_ };
+  }
+
+private:
+  std::unique_ptr<std::byte[]> data_;
+  std::size_t size_;
+  std::size_t capacity_;
+};
+
+/* A coroutine.  Started by loop::spawn, or by co_await in another
+ * task, which then carries on when it is over. */
+class task {
+public:
+  struct promise_type {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    task get_return_object ()
+    {
+      return task (std::coroutine_handle<promise_type>::from_promise (*this));
+    }
+    std::suspend_always initial_suspend () noexcept { return {}; }
+    auto final_suspend () noexcept
+    {
+      struct resume_caller {
+	bool await_ready () noexcept { return false; }
+	std::coroutine_handle<>
+	await_suspend (std::coroutine_handle<promise_type> h) noexcept
+	{
+	  if (h.promise ().continuation)
+	    return h.promise ().continuation;
+	  return std::noop_coroutine ();
+	}
+	void await_resume () noexcept {}
+      };
+      return resume_caller {};
+    }
+    void return_void () {}
+    void unhandled_exception () { error = std::current_exception (); }
+  };
+  using handle = std::coroutine_handle<promise_type>;
+
+  task (task &&t) noexcept : h_ (std::exchange (t.h_, {})) {}
+  task &operator= (task &&t) noexcept
+  {
+    if (this != &t) {
+      if (h_)
+	h_.destroy ();
+      h_ = std::exchange (t.h_, {});
+    }
+    return *this;
+  }
+  ~task ()
+  {
+    if (h_)
+      h_.destroy ();
+  }
+
+  bool await_ready () const noexcept { return false; }
+  std::coroutine_handle<> await_suspend (std::coroutine_handle<> caller)
+  {
+    h_.promise ().continuation = caller;
+    return h_;
+  }
+  void await_resume ()
+  {
+    if (h_.promise ().error)
+      std::rethrow_exception (h_.promise ().error);
+  }
+
+private:
+  friend class loop;
+  explicit task (handle h) : h_ (h) {}
+  handle h_;
+};
+
+/* The rlib loop of this thread, and the coroutines waiting on it */
+class loop {
+public:
+  explicit loop (const struct config_common &cc,
+		 const struct rel_loop_options *opts = nullptr)
+    : l_ (rel_loop_new (&cc, opts))
+  {
+    if (!l_)
+      throw_errno ("rel_loop_new");
+  }
+  loop (const loop &) = delete;
+  loop &operator= (const loop &) = delete;
+  ~loop ()
+  {
+    for (auto h : tasks_)
+      h.destroy ();
+    for (auto &a : accepted_)
+      ::close (a.fd);
+    rel_loop_free (l_);
+  }
+
+  rel_loop_t *get () { return l_; }
+
+  /* Start t at the next turn of run */
+  void spawn (task t)
+  {
+    task::handle h = std::exchange (t.h_, {});
+    tasks_.push_back (h);
+    ready_.push_back (h);
+  }
+
+  /* Run until every task is over and every connection closed.  An
+   * exception a task lets out is thrown from here. */
+  void run ();
+
+  /* rel_connect */
+  connection connect (const char *local, const char *remote);
+
+  /* Resume h once fd is ready for events (POLLIN or POLLOUT) */
+  void wait (int fd, short events, std::coroutine_handle<> h)
+  {
+    waiters_.push_back ({ fd, events, h });
+  }
+
+private:
+  friend class listener;
+
+  struct waiter {
+    int fd;
+    short events;
+    std::coroutine_handle<> h;
+  };
+  struct accepted {
+    int fd;
+    struct sockaddr_storage peer;
+  };
+  struct acceptor {
+    accepted *slot;
+    std::coroutine_handle<> h;
+  };
+
+  static int on_accept (int fd, const struct sockaddr_storage *peer,
+			void *arg);
+  void poll_waiters ();
+  void reap ();
+
+  rel_loop_t *l_;
+  int nconns_ = -1;			/* unknown until the first poll */
+  std::vector<task::handle> tasks_;	/* spawned and not over yet */
+  std::deque<std::coroutine_handle<>> ready_;
+  std::vector<waiter> waiters_;
+  int server_ = 0;			/* rel_listen done */
+  int listening_ = 0;			/* listeners alive */
+  std::deque<accepted> accepted_;	/* no accept waiting for them */
+  std::deque<acceptor> acceptors_;	/* accepts waiting */
+};
+
+/* The application end of a connection */
+class connection {
+public:
+  connection () = default;
+  connection (loop &lp, int fd, const struct sockaddr_storage *peer = nullptr)
+    : loop_ (&lp), fd_ (fd)
+  {
+    make_async (fd_);
+    if (peer)
+      peer_ = *peer;
+  }
+  connection (connection &&c) noexcept
+    : loop_ (c.loop_), fd_ (std::exchange (c.fd_, -1)), peer_ (c.peer_) {}
+  connection &operator= (connection &&c) noexcept
+  {
+    if (this != &c) {
+      close ();
+      loop_ = c.loop_;
+      fd_ = std::exchange (c.fd_, -1);
+      peer_ = c.peer_;
+    }
+    return *this;
+  }
+  ~connection () { close (); }
+
+  explicit operator bool () const { return fd_ >= 0; }
+  int fd () const { return fd_; }
+  /* Of an accepted connection */
+  const struct sockaddr_storage &peer () const { return peer_; }
+
+  void close ()
+  {
+    if (fd_ >= 0)
+      ::close (fd_);
+    fd_ = -1;
+  }
+  /* Send an EOF; what the peer sends can still be read */
+  void close_write () { ::shutdown (fd_, SHUT_WR); }
+
+  /* read or write_some: completes once it has moved some bytes */
+  struct io {
+    loop *lp;
+    int fd;
+    short events;
+    std::span<std::byte> buf;
+    ssize_t n = 0;
+    int err = 0;
+
+    bool await_ready () { return attempt () != EAGAIN; }
+    void await_suspend (std::coroutine_handle<> h)
+    {
+      lp->wait (fd, events, h);
+    }
+    std::size_t await_resume ()
+    {
+      if (err == EAGAIN)
+	attempt ();
+      if (err)
+	throw_errno (events == POLLIN ? "read" : "write", err);
+      return n;
+    }
+    int attempt ()
+    {
+      n = events == POLLIN ? ::read (fd, buf.data (), buf.size ())
+	: ::write (fd, buf.data (), buf.size ());
+      err = n < 0 ? errno : 0;
+      return err;
+    }
+  };
+
+  struct buffer_io : io {
+    buffer *b;
+
+    std::size_t await_resume ()
+    {
+      b->resize (io::await_resume ());
+      return b->size ();
+    }
+  };
+
+  /* Bytes read, 0 at EOF */
+  io read (std::span<std::byte> buf) { return { loop_, fd_, POLLIN, buf }; }
+  /* Into the room of buf, which is then of the size read */
+  buffer_io read (buffer &buf)
+  {
+    return { { loop_, fd_, POLLIN, buf.room () }, &buf };
+  }
+  io write_some (std::span<const std::byte> buf)
+  {
+    return { loop_, fd_, POLLOUT,
+	     { const_cast<std::byte *> (buf.data ()), buf.size () } };
+  }
+
+  /* All of buf */
+  task write (std::span<const std::byte> buf)
+  {
+    while (!buf.empty ())
+      buf = buf.subspan (co_await write_some (buf));
+  }
+
+private:
+  loop *loop_ = nullptr;
+  int fd_ = -1;
+  struct sockaddr_storage peer_ = {};
+};
+
+/* rel_listen.  A loop listens on one port only, that of its first
+ * listener; while no listener is left, new connections are refused. */
+class listener {
+public:
+  listener (loop &lp, const char *local) : loop_ (&lp)
+  {
+    if (!lp.server_
+	&& rel_listen (lp.get (), local, &loop::on_accept, &lp) < 0)
+      throw_errno ("rel_listen");
+    lp.server_ = 1;
+    lp.listening_++;
+  }
+  listener (const listener &) = delete;
+  listener &operator= (const listener &) = delete;
+  ~listener () { loop_->listening_--; }
+
+  struct accept_awaiter {
+    loop *lp;
+    loop::accepted a = { -1, {} };
+
+    bool await_ready ()
+    {
+      if (lp->accepted_.empty ())
+	return false;
+      a = lp->accepted_.front ();
+      lp->accepted_.pop_front ();
+      return true;
+    }
+    void await_suspend (std::coroutine_handle<> h)
+    {
+      lp->acceptors_.push_back ({ &a, h });
+    }
+    connection await_resume () { return connection (*lp, a.fd, &a.peer); }
+  };
+
+  accept_awaiter accept () { return { loop_ }; }
+
+private:
+  loop *loop_;
+};
+
+inline int
+loop::on_accept (int fd, const struct sockaddr_storage *peer, void *arg)
+{
+  loop *lp = static_cast<loop *> (arg);
+
+  if (!lp->listening_)
+    return -1;
+  if (!lp->acceptors_.empty ()) {
+    acceptor a = lp->acceptors_.front ();
+    lp->acceptors_.pop_front ();
+    *a.slot = { fd, *peer };
+    lp->ready_.push_back (a.h);
+  }
+  else
+    lp->accepted_.push_back ({ fd, *peer });
+  return 0;
+}
+
+inline connection
+loop::connect (const char *local, const char *remote)
+{
+  int fd = rel_connect (l_, local, remote);
+
+  if (fd < 0)
+    throw_errno ("rel_connect");
+  return connection (*this, fd);
+}
+
+/* Move the waiters whose descriptors are ready to ready_ */
+inline void
+loop::poll_waiters ()
+{
+  std::vector<struct pollfd> pfd (waiters_.size ());
+  std::size_t i, j;
+
+  for (i = 0; i < waiters_.size (); i++)
+    pfd[i] = { waiters_[i].fd, waiters_[i].events, 0 };
+  if (::poll (pfd.data (), pfd.size (), 0) <= 0)
+    return;
+  for (i = j = 0; i < waiters_.size (); i++)
+    if (pfd[i].revents)
+      ready_.push_back (waiters_[i].h);
+    else
+      waiters_[j++] = waiters_[i];
+  waiters_.resize (j);
+}
+
+/* Free the tasks that are over */
+inline void
+loop::reap ()
+{
+  std::exception_ptr error;
+  std::size_t i, j;
+
+  for (i = j = 0; i < tasks_.size (); i++)
+    if (tasks_[i].done ()) {
+      if (!error)
+	error = tasks_[i].promise ().error;
+      tasks_[i].destroy ();
+    }
+    else
+      tasks_[j++] = tasks_[i];
+  tasks_.resize (j);
+  if (error)
+    std::rethrow_exception (error);
+}
+
+inline void
+loop::run ()
+{
+  for (;;) {
+    /* Whatever they do, the transport only moves the bytes at the next
+     * rel_loop_poll: descriptors cannot become ready meanwhile */
+    while (!ready_.empty ()) {
+      std::coroutine_handle<> h = ready_.front ();
+      ready_.pop_front ();
+      h.resume ();
+    }
+    reap ();
+    if (tasks_.empty () && nconns_ == 0)
+      return;
+    nconns_ = rel_loop_poll (l_);
+    if (!waiters_.empty ())
+      poll_waiters ();
+  }
+}
+
+} // namespace rel
+
+#endif /* LIBREL_HH */
@@ -0,0 +1,704 @@
+/* Load generator for reliable in server mode.
+ *
+ * load emulates up to -n clients, each on a UDP socket and source port
+ * of its own, all speaking the plain wire protocol (no -T, -F, -Z or
+ * -P options) to "reliable -s".  The server's destination should be
+ * load itself: it listens on TCP port -k and counts what the server
+ * delivers on each connection.  The first 4 bytes a client sends are
+ * its index, so each TCP connection can be matched to its client.
+ *
+ *   ./reliable -s -w 4 6000 localhost:7000 &
+ *   ./load -w 4 -p $! -n 10000 -s 1000 localhost:6000
+ *
+ * Clients are opened -s at a time.  After each step, once the new ones
+ * are set up, all of them send for -t seconds, and load reports:
+ *
+ *   new/s     connections set up per second (first Data packet to its Ack)
+ *   MB/s      payload delivered to the sink, all clients together
+ *   fair      Jain's index of the bytes each client got through (1 = even)
+ *   KB/conn   growth of the server's RSS since the start (-p), per client
+ *   ack ms    time from a Data packet to its Ack, p50/p99/max, taken on
+ *             packets sent once only.  On loopback this is the time the
+ *             server's event loop takes to get round to a packet.
+ *   retx      Data packets retransmitted
+ *
+ * The window (-w) must not be larger than the server's.  In the end all
+ * clients send EOF, and load reports how many connections the server
+ * closed, and its RSS after they are gone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+
+#define NSEC 1000000000ULL
+#define TICK_MS 10		/* timers and pacing */
+#define LAT_SAMPLES 65536	/* ack latencies kept per step */
+#define EVENTS 256
+
+#define ACK_SIZE 8
+#define HDR_SIZE 12
+#define MAX_PAYLOAD 500
+
+char *progname;
+
+enum { T_CLIENT, T_SINK, T_LISTEN };
+
+/* A Data packet sent and not acked yet */
+struct slot {
+  uint64_t time;
+  uint16_t len;			/* of the payload */
+  uint8_t retx;			/* sent more than once */
+};
+
+struct client {
+  int type;			/* T_CLIENT */
+  int fd;			/* -1 once closed */
+  uint32_t index;
+
+  uint32_t next;		/* seqno of the next new Data packet */
+  uint32_t una;			/* oldest seqno not acked */
+  uint32_t rcv_next;		/* next seqno expected from the server */
+  uint64_t sent;		/* payload bytes sent once */
+  uint64_t opened;		/* time seqno 1 first went out */
+  uint64_t setup;		/* time it was acked, 0 until then */
+  uint64_t rto_at;		/* retransmit at, 0 when nothing is unacked */
+  double credit;		/* bytes it may send now (-r) */
+  uint64_t delivered;		/* bytes the sink got from it */
+  uint64_t mark;		/* delivered at the start of the step */
+  struct slot *win;		/* -w slots, indexed by seqno % window */
+
+  unsigned eof_sent : 1;
+  unsigned eof_acked : 1;
+  unsigned peer_eof : 1;
+  unsigned failed : 1;
+};
+
+/* A TCP connection from the server to the sink */
+struct sink {
+  int type;			/* T_SINK */
+  int fd;
+  int have;			/* bytes of the client index read so far */
+  uint8_t hdr[4];
+  struct client *c;
+};
+
+static int listen_type = T_LISTEN;
+
+static int window = 1;
+static uint64_t rto = 2000 * 1000000ULL;
+static uint64_t nbytes;		/* per client, 0 = until the end */
+static double rate;		/* per client, bytes/s, 0 = as fast as it can */
+
+static int ep;
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static struct client *clients;
+static uint32_t nopen;		/* clients opened so far */
+static uint32_t pending;	/* opened, not set up yet */
+static uint32_t live;		/* opened, not closed yet */
+static uint32_t nfailed;
+static int closing;		/* the end: every client sends EOF */
+
+/* Per step counters */
+static uint64_t last_setup;
+static uint64_t retx;
+static uint32_t lat[LAT_SAMPLES];	/* usec */
+static uint64_t nlat;
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static void
+fatal (const char *what)
+{
+  fprintf (stderr, "%s: %s: %s\n", progname, what, strerror (errno));
+  exit (2);
+}
+
+static void *
+xcalloc (size_t n, size_t size)
+{
+  void *p = calloc (n, size);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory\n", progname);
+    exit (2);
+  }
+  return p;
+}
+
+static void
+set_nonblock (int fd)
+{
+  int n;
+  if ((n = fcntl (fd, F_GETFL)) < 0 || fcntl (fd, F_SETFL, n | O_NONBLOCK) < 0)
+    fatal ("fcntl");
+}
+
+static void
+watch (int fd, void *p)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = p;
+  if (epoll_ctl (ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+    fatal ("epoll_ctl");
+}
+
+/* Reservoir sampling: every latency has the same chance to be kept */
+static void
+sample_latency (uint64_t ns)
+{
+  uint64_t i = nlat++;
+
+  if (i >= LAT_SAMPLES) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    i = rng % nlat;
+    if (i >= LAT_SAMPLES)
+      return;
+  }
+  lat[i] = ns / 1000;
+}
+
+/* Clients */
+
+static void
+client_close (struct client *c)
+{
+  close (c->fd);
+  c->fd = -1;
+  free (c->win);
+  c->win = NULL;
+  live--;
+}
+
+static void
+client_fail (struct client *c)
+{
+  c->failed = 1;
+  nfailed++;
+  if (!c->setup)
+    pending--;
+  client_close (c);
+}
+
+static void
+send_packet (struct client *c, packet_t *pkt, size_t len)
+{
+  pkt->cksum = 0;
+  pkt->cksum = cksum (pkt, len);
+  /* A full socket buffer is a lost packet, like any other */
+  if (send (c->fd, pkt, len, 0) < 0 && errno != EAGAIN
+      && errno != ENOBUFS)
+    client_fail (c);
+}
+
+static void
+send_data (struct client *c, uint32_t seqno)
+{
+  packet_t pkt;
+  struct slot *s = &c->win[seqno % window];
+
+  pkt.len = htons (HDR_SIZE + s->len);
+  pkt.ackno = htonl (c->rcv_next);
+  pkt.seqno = htonl (seqno);
+  memset (pkt.data, 0, s->len);
+  /* The sink tells clients apart by the first 4 bytes */
+  if (seqno == 1 && s->len >= 4) {
+    uint32_t index = htonl (c->index);
+    memcpy (pkt.data, &index, 4);
+  }
+  send_packet (c, &pkt, HDR_SIZE + s->len);
+}
+
+static void
+send_ack (struct client *c)
+{
+  struct ack_packet ack;
+
+  ack.len = htons (ACK_SIZE);
+  ack.ackno = htonl (c->rcv_next);
+  send_packet (c, (packet_t *) &ack, ACK_SIZE);
+}
+
+/* Send new Data packets while the window and -r allow */
+static void
+client_send (struct client *c, uint64_t now)
+{
+  while (c->fd >= 0 && !c->eof_sent && c->next - c->una < (uint32_t) window) {
+    struct slot *s = &c->win[c->next % window];
+    uint64_t left = nbytes ? nbytes - c->sent : MAX_PAYLOAD;
+
+    if (closing || left == 0)
+      s->len = 0;
+    else {
+      s->len = left < MAX_PAYLOAD ? left : MAX_PAYLOAD;
+      if (rate) {
+	if (c->credit < s->len)
+	  break;
+	c->credit -= s->len;
+      }
+      c->sent += s->len;
+    }
+    s->time = now;
+    s->retx = 0;
+    if (s->len == 0)
+      c->eof_sent = 1;
+    if (c->next == 1)
+      c->opened = now;
+    if (!c->rto_at)
+      c->rto_at = now + rto;
+    send_data (c, c->next++);
+  }
+}
+
+static void
+client_open (struct client *c)
+{
+  c->type = T_CLIENT;
+  c->fd = socket (server.ss_family, SOCK_DGRAM, 0);
+  if (c->fd < 0)
+    fatal ("socket");
+  set_nonblock (c->fd);
+  /* Connected, so that the kernel only passes the server's packets up,
+   * and reports it unreachable */
+  if (connect (c->fd, (struct sockaddr *) &server, server_len) < 0)
+    fatal ("connect");
+  c->next = c->una = c->rcv_next = 1;
+  c->win = xcalloc (window, sizeof (*c->win));
+  c->credit = rate ? MAX_PAYLOAD : 0;
+  watch (c->fd, c);
+  nopen++;
+  pending++;
+  live++;
+  client_send (c, now_ns ());
+}
+
+static void
+client_ack (struct client *c, uint32_t ackno, uint64_t now)
+{
+  if (ackno - c->una - 1 >= c->next - c->una)
+    return;			/* old or bogus */
+  for (; c->una != ackno; c->una++) {
+    struct slot *s = &c->win[c->una % window];
+    if (!s->retx)
+      sample_latency (now - s->time);
+    if (c->una == 1) {
+      c->setup = now;
+      last_setup = now;
+      pending--;
+    }
+  }
+  c->rto_at = c->una == c->next ? 0 : now + rto;
+  if (c->eof_sent && c->una == c->next)
+    c->eof_acked = 1;
+}
+
+static void
+client_recv (struct client *c)
+{
+  packet_t pkt;
+  ssize_t n;
+  uint64_t now = now_ns ();
+
+  while (c->fd >= 0 && (n = recv (c->fd, &pkt, sizeof (pkt), 0)) != 0) {
+    size_t len;
+
+    if (n < 0) {
+      if (errno == EAGAIN)
+	break;
+      client_fail (c);		/* ECONNREFUSED: no server */
+      return;
+    }
+    len = ntohs (pkt.len);
+    if ((size_t) n < len || len < ACK_SIZE || cksum (&pkt, len) != 0xffff)
+      continue;
+    client_ack (c, ntohl (pkt.ackno), now);
+    if (len >= HDR_SIZE) {
+      if (ntohl (pkt.seqno) == c->rcv_next) {
+	c->rcv_next++;
+	if (len == HDR_SIZE)
+	  c->peer_eof = 1;
+      }
+      send_ack (c);
+    }
+  }
+  if (c->fd < 0)
+    return;
+  if (c->eof_acked && c->peer_eof)
+    client_close (c);
+  else
+    client_send (c, now);
+}
+
+/* Retransmissions and pacing, every TICK_MS */
+static void
+client_tick (struct client *c, uint64_t now, double dt)
+{
+  if (c->fd < 0)
+    return;
+  if (c->rto_at && now >= c->rto_at) {
+    uint32_t seqno;
+    for (seqno = c->una; seqno != c->next && c->fd >= 0; seqno++) {
+      c->win[seqno % window].retx = 1;
+      send_data (c, seqno);
+      retx++;
+    }
+    c->rto_at = now + rto;
+  }
+  if (rate) {
+    c->credit += rate * dt;
+    /* Do not save up more than a window */
+    if (c->credit > (double) window * MAX_PAYLOAD)
+      c->credit = (double) window * MAX_PAYLOAD;
+  }
+  client_send (c, now);
+}
+
+/* The sink */
+
+static void
+sink_accept (int lfd)
+{
+  int fd;
+
+  while ((fd = accept (lfd, NULL, NULL)) >= 0) {
+    struct sink *k = xcalloc (1, sizeof (*k));
+    set_nonblock (fd);
+    k->type = T_SINK;
+    k->fd = fd;
+    watch (fd, k);
+  }
+  if (errno != EAGAIN)
+    fatal ("accept");
+}
+
+static void
+sink_read (struct sink *k)
+{
+  static char buf[65536];
+  ssize_t n;
+
+  while ((n = read (k->fd, buf, sizeof (buf))) > 0) {
+    ssize_t i;
+    for (i = 0; k->have < 4 && i < n; i++) {
+      k->hdr[k->have++] = buf[i];
+      if (k->have == 4) {
+	uint32_t index;
+	memcpy (&index, k->hdr, 4);
+	index = ntohl (index);
+	if (index < nopen)
+	  k->c = &clients[index];
+      }
+    }
+    if (k->c)
+      k->c->delivered += n;
+  }
+  if (n < 0 && errno == EAGAIN)
+    return;
+  /* EOF, which the server passes back to the client */
+  close (k->fd);
+  free (k);
+}
+
+static int
+sink_listen (const char *port)
+{
+  struct sockaddr_in6 sin6;
+  int fd, one = 1;
+
+  fd = socket (AF_INET6, SOCK_STREAM, 0);
+  if (fd < 0)
+    fatal ("socket");
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  memset (&sin6, 0, sizeof (sin6));
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_port = htons (atoi (port));
+  sin6.sin6_addr = in6addr_any;
+  if (bind (fd, (struct sockaddr *) &sin6, sizeof (sin6)) < 0)
+    fatal ("bind");
+  if (listen (fd, 4096) < 0)
+    fatal ("listen");
+  set_nonblock (fd);
+  return fd;
+}
+
+/* The event loop */
+
+static int lfd;
+static uint64_t next_tick;
+
+static void
+loop_once (void)
+{
+  struct epoll_event ev[EVENTS];
+  uint64_t now = now_ns ();
+  int i, n, ms;
+
+  ms = now >= next_tick ? 0 : (next_tick - now) / 1000000 + 1;
+  n = epoll_wait (ep, ev, EVENTS, ms);
+  if (n < 0 && errno != EINTR)
+    fatal ("epoll_wait");
+  for (i = 0; i < n; i++) {
+    int type = *(int *) ev[i].data.ptr;
+    if (type == T_CLIENT)
+      client_recv (ev[i].data.ptr);
+    else if (type == T_SINK)
+      sink_read (ev[i].data.ptr);
+    else
+      sink_accept (lfd);
+  }
+
+  now = now_ns ();
+  if (now >= next_tick) {
+    double dt = (now - next_tick) / 1e9 + TICK_MS / 1e3;
+    uint32_t j;
+    for (j = 0; j < nopen; j++)
+      client_tick (&clients[j], now, dt);
+    next_tick = now + TICK_MS * 1000000ULL;
+  }
+}
+
+/* Reports */
+
+static long
+server_rss (pid_t pid)
+{
+  char path[64], line[256];
+  long kb = -1;
+  FILE *f;
+
+  if (!pid)
+    return -1;
+  snprintf (path, sizeof (path), "/proc/%d/status", (int) pid);
+  if (!(f = fopen (path, "r")))
+    return -1;
+  while (fgets (line, sizeof (line), f))
+    if (sscanf (line, "VmRSS: %ld", &kb) == 1)
+      break;
+  fclose (f);
+  return kb;
+}
+
+static int
+cmp_u32 (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile (uint32_t n, double p)
+{
+  return n ? lat[(uint32_t) ((n - 1) * p)] / 1e3 : 0;
+}
+
+static void
+report_step (uint32_t first, uint64_t setup_ns, double secs, long rss0,
+	     pid_t pid)
+{
+  double sum = 0, sum2 = 0, kb = -1;
+  uint32_t i, active = 0, ok = 0, n;
+  long rss;
+
+  for (i = 0; i < nopen; i++) {
+    struct client *c = &clients[i];
+    double d = c->delivered - c->mark;
+    if (c->failed)
+      continue;
+    active++;
+    sum += d;
+    sum2 += d * d;
+    if (i >= first && c->setup)
+      ok++;
+  }
+  n = nlat < LAT_SAMPLES ? nlat : LAT_SAMPLES;
+  qsort (lat, n, sizeof (lat[0]), cmp_u32);
+  rss = server_rss (pid);
+  if (rss >= 0 && rss0 >= 0 && nopen)
+    kb = (double) (rss - rss0) / nopen;
+
+  printf ("%7" PRIu32 " %8.0f %8.2f %6.3f ", active,
+	  setup_ns ? ok / (setup_ns / 1e9) : 0, sum / secs / 1e6,
+	  sum2 ? sum * sum / (active * sum2) : 0);
+  if (kb >= 0)
+    printf ("%8.1f", kb);
+  else
+    printf ("%8s", "-");
+  printf (" %7.2f %7.2f %7.2f %7" PRIu64 "\n", percentile (n, 0.5),
+	  percentile (n, 0.99), n ? lat[n - 1] / 1e3 : 0, retx);
+  fflush (stdout);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-n clients] [-s step] [-t secs] [-w window]\n"
+	   "            [-T timeout] [-b bytes] [-r rate] [-k sink-port]"
+	   " [-p server-pid]\n"
+	   "            host:port\n"
+	   "  timeout in ms; rate in kB/s per client; bytes per client,"
+	   " 0 = no limit\n", progname);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct addrinfo hints, *ai;
+  struct rlimit rl;
+  const char *sinkport = "7000";
+  char *host, *port;
+  uint32_t nclients = 1000, step = 0, i;
+  double secs = 2;
+  pid_t pid = 0;
+  long rss0;
+  uint64_t t;
+  int opt, err;
+
+  progname = strrchr (argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  while ((opt = getopt (argc, argv, "n:s:t:w:T:b:r:k:p:")) != -1)
+    switch (opt) {
+    case 'n':
+      nclients = atol (optarg);
+      break;
+    case 's':
+      step = atol (optarg);
+      break;
+    case 't':
+      secs = atof (optarg);
+      break;
+    case 'w':
+      window = atoi (optarg);
+      break;
+    case 'T':
+      rto = atof (optarg) * 1e6;
+      break;
+    case 'b':
+      nbytes = strtoull (optarg, NULL, 0);
+      break;
+    case 'r':
+      rate = atof (optarg) * 1000;
+      break;
+    case 'k':
+      sinkport = optarg;
+      break;
+    case 'p':
+      pid = atoi (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc - 1 || nclients < 1 || window < 1 || secs <= 0
+      || rto < 10000000 || rate < 0)
+    usage ();
+  if (!step || step > nclients)
+    step = nclients < 10 ? nclients : nclients / 10;
+
+  host = argv[optind];
+  port = strrchr (host, ':');
+  if (!port)
+    usage ();
+  *port++ = '\0';
+  if (*host == '[' && host[strlen (host) - 1] == ']') {
+    host++;
+    host[strlen (host) - 1] = '\0';
+  }
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((err = getaddrinfo (host, port, &hints, &ai))) {
+    fprintf (stderr, "%s: %s: %s\n", progname, host, gai_strerror (err));
+    exit (2);
+  }
+  memcpy (&server, ai->ai_addr, ai->ai_addrlen);
+  server_len = ai->ai_addrlen;
+  freeaddrinfo (ai);
+
+  /* A descriptor per client, and one per connection to the sink */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+  }
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0
+      && rl.rlim_cur < 2 * (rlim_t) nclients + 16)
+    fprintf (stderr, "%s: warning: %lu descriptors are not enough for %"
+	     PRIu32 " clients\n", progname, (unsigned long) rl.rlim_cur,
+	     nclients);
+
+  if ((ep = epoll_create1 (0)) < 0)
+    fatal ("epoll_create1");
+  lfd = sink_listen (sinkport);
+  watch (lfd, &listen_type);
+  clients = xcalloc (nclients, sizeof (*clients));
+  rss0 = server_rss (pid);
+  next_tick = now_ns ();
+
+  printf ("clients    new/s     MB/s   fair  KB/conn  ack ms p50     p99"
+	  "     max    retx\n");
+  while (nopen < nclients) {
+    uint32_t first = nopen, n = nclients - nopen < step ? nclients - nopen
+      : step;
+    uint64_t start = now_ns (), setup_ns;
+
+    for (i = 0; i < n; i++) {
+      clients[nopen].index = nopen;
+      client_open (&clients[nopen]);
+    }
+    /* Wait for the new ones, at most as long as a step runs */
+    while (pending && now_ns () - start < secs * NSEC)
+      loop_once ();
+    setup_ns = last_setup > start ? last_setup - start : 0;
+
+    for (i = 0; i < nopen; i++)
+      clients[i].mark = clients[i].delivered;
+    nlat = retx = 0;
+    t = now_ns ();
+    while (now_ns () - t < secs * NSEC)
+      loop_once ();
+    report_step (first, setup_ns, (now_ns () - t) / 1e9, rss0, pid);
+  }
+
+  /* Close everything, and see what the server gives back */
+  closing = 1;
+  t = now_ns ();
+  for (i = 0; i < nopen; i++)
+    client_send (&clients[i], t);
+  while (live && now_ns () - t < 2 * rto + secs * NSEC)
+    loop_once ();
+  printf ("closed %" PRIu32 "/%" PRIu32 " in %.2f s, %" PRIu32 " failed",
+	  nopen - live - nfailed, nopen, (now_ns () - t) / 1e9, nfailed);
+  /* Give the server time to free what it held */
+  t = now_ns ();
+  while (now_ns () - t < NSEC / 2)
+    loop_once ();
+  if (server_rss (pid) >= 0)
+    printf (", server RSS %ld kB (%ld kB at start)", server_rss (pid), rss0);
+  printf ("\n");
+  return live || nfailed;
+}
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t
+read32 (const uint8_t *p)
+{
+  uint32_t v;
+  memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline uint32_t
+lz_hash (uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Bytes taken by a length of n in a token nibble plus extra bytes,
+ * beyond the nibble itself. */
+static inline size_t
+length_bytes (size_t n)
+{
+  return n >= 15 ? 1 + (n - 15) / 255 : 0;
+}
+
+static uint8_t *
+put_length (uint8_t *op, size_t n)
+{
+  if (n >= 15) {
+    for (n -= 15; n >= 255; n -= 255)
+      *op++ = 255;
+    *op++ = n;
+  }
+  return op;
+}
+
+static uint8_t *
+put_literals (uint8_t *op, const uint8_t *lit, size_t n, size_t match)
+{
+  *op++ = (n >= 15 ? 15 : n) << 4 | (match >= 15 ? 15 : match);
+  op = put_length (op, n);
+  memcpy (op, lit, n);
+  return op + n;
+}
+
+size_t
+lz_compress (const void *_src, size_t srclen, void *_dst, size_t dstmax,
+	     size_t *consumed)
+{
+  const uint8_t *src = _src;
+  uint8_t *dst = _dst, *op = dst;
+  /* Position + 1 of the last occurrence of each hash, 0 for none */
+  uint32_t table[1 << LZ_HASH_BITS];
+  size_t ip = 0, anchor = 0, lit, avail;
+
+  memset (table, 0, sizeof (table));
+
+  while (ip + LZ_MIN_MATCH <= srclen) {
+    uint32_t h = lz_hash (read32 (src + ip));
+    size_t ref = table[h], len, need;
+
+    table[h] = ip + 1;
+    if (!ref-- || ip - ref > LZ_MAX_OFFSET
+	|| read32 (src + ref) != read32 (src + ip)) {
+      ip++;
+      continue;
+    }
+
+    for (len = LZ_MIN_MATCH; ip + len < srclen && src[ref + len] == src[ip + len];
+	 len++)
+      ;
+    lit = ip - anchor;
+    need = 1 + length_bytes (lit) + lit + 2
+      + length_bytes (len - LZ_MIN_MATCH);
+    if (op + need > dst + dstmax)
+      break;
+
+    op = put_literals (op, src + anchor, lit, len - LZ_MIN_MATCH);
+    *op++ = (ip - ref) & 0xff;
+    *op++ = (ip - ref) >> 8;
+    op = put_length (op, len - LZ_MIN_MATCH);
+
+    ip += len;
+    anchor = ip;
+  }
+
+  /* Whatever is left goes out as literals, as far as it fits */
+  lit = srclen - anchor;
+  avail = dst + dstmax - op;
+  if (lit > avail)
+    lit = avail;
+  while (lit > 0 && 1 + length_bytes (lit) + lit > avail)
+    lit--;
+  if (lit > 0)
+    op = put_literals (op, src + anchor, lit, 0);
+
+  *consumed = anchor + lit;
+  return op - dst;
+}
+
+/* Read the rest of a length whose token nibble was 15 */
+static int
+get_length (const uint8_t **ip, const uint8_t *end, size_t *n)
+{
+  uint8_t b;
+
+  if (*n < 15)
+    return 0;
+  do {
+    if (*ip >= end)
+      return -1;
+    b = *(*ip)++;
+    *n += b;
+  } while (b == 255);
+  return 0;
+}
+
+ssize_t
+lz_decompress (const void *_src, size_t srclen, void *_dst, size_t dstmax)
+{
+  const uint8_t *ip = _src, *end = ip + srclen;
+  uint8_t *dst = _dst, *op = dst, *oend = dst + dstmax;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t lit = token >> 4, len = token & 15, offset;
+
+    if (get_length (&ip, end, &lit) < 0
+	|| lit > (size_t) (end - ip) || lit > (size_t) (oend - op))
+      return -1;
+    memcpy (op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (get_length (&ip, end, &len) < 0)
+      return -1;
+    len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - dst)
+	|| len > (size_t) (oend - op))
+      return -1;
+    /* Byte by byte: the source may overlap what is being written */
+    for (; len > 0; len--, op++)
+      *op = op[-offset];
+  }
+
+  return op - dst;
+}
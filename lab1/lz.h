@@ -0,0 +1,41 @@
+/* Small LZ77 codec for packet payloads.
+
+   A compressed block is a series of sequences, each a run of literal
+   bytes followed by a match, that is a copy of earlier output:
+
+     token            literal length << 4 | (match length - 4)
+     [length bytes]   if a length in the token is 15: more of it,
+                      in bytes of 255 ended by one below 255
+     literals
+     offset           2 bytes, little-endian, 1 to 65535 back
+     [length bytes]   of the match length, as above
+
+   The last sequence of a block has no match: the block ends right
+   after its literals.  This is the LZ4 block format, minus its rules
+   about the end of a block, which only serve its unchecked decoder.
+
+   The encoder is greedy with a single hash probe per position; it
+   aims at speed rather than ratio. */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define LZ_MIN_MATCH     4
+#define LZ_HASH_BITS     12
+
+/* Compress as much of src as fits in dstmax bytes of output.  Returns
+ * the size of the output, and the number of bytes of src it holds in
+ * *consumed.  The output is only worth sending if it is smaller than
+ * *consumed. */
+size_t lz_compress (const void *src, size_t srclen, void *dst, size_t dstmax,
+		    size_t *consumed);
+
+/* Decompress a block into at most dstmax bytes.  Returns the size of
+ * the output, or -1 if the block is malformed or does not fit. */
+ssize_t lz_decompress (const void *src, size_t srclen, void *dst,
+		       size_t dstmax);
+
+#endif /* LZ_H */
@@ -0,0 +1,311 @@
+/* Microbenchmarks for the per-packet primitives of rlib.
+ *
+ * rlib.c is compiled into this file so that its static functions and
+ * data (conn_mkevents, conn_drain, the connection list) can be driven
+ * directly.  Each benchmark is timed for about BENCH_MSEC and the best
+ * of BENCH_RUNS runs is reported, in nanoseconds and allocations per
+ * operation.  Build with "make microbench" (links with
+ * -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc to count allocations).
+ */
+
+#define main rlib_main
+#include "rlib.c"
+#undef main
+
+#define BENCH_MSEC 200
+#define BENCH_RUNS 3
+
+/* Stubs for the protocol side, which the benchmarks never reach */
+rel_t *rel_create (conn_t *c, const struct sockaddr_storage *ss,
+		   const struct config_common *cc) { return NULL; }
+void rel_destroy (rel_t *r) {}
+void rel_recvpkt (rel_t *r, packet_t *pkt, size_t len) {}
+void rel_demux (const struct config_common *cc,
+		const struct sockaddr_storage *ss,
+		packet_t *pkt, size_t len) {}
+void rel_read (rel_t *r) {}
+void rel_output (rel_t *r) {}
+void rel_timer (void) {}
+void rel_stats (void) {}
+
+/* At -O2, GCC turns xmalloc followed by memset into calloc: count
+ * every way of getting memory */
+static unsigned long allocs;
+
+void *__real_malloc (size_t);
+void *
+__wrap_malloc (size_t n)
+{
+  allocs++;
+  return __real_malloc (n);
+}
+
+void *__real_calloc (size_t, size_t);
+void *
+__wrap_calloc (size_t n, size_t size)
+{
+  allocs++;
+  return __real_calloc (n, size);
+}
+
+void *__real_realloc (void *, size_t);
+void *
+__wrap_realloc (void *p, size_t n)
+{
+  allocs++;
+  return __real_realloc (p, n);
+}
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The result of every benchmark goes here, so that the compiler
+ * cannot optimize the work away. */
+static volatile unsigned long sink;
+
+static void
+bench (const char *name, void (*fn) (long))
+{
+  long iters = 1;
+  double t, best = 0;
+  unsigned long a = 0;
+  int run;
+
+  /* Find how many iterations take about BENCH_MSEC */
+  for (;;) {
+    t = now_ns ();
+    fn (iters);
+    t = now_ns () - t;
+    if (t > BENCH_MSEC * 1e6 / 10)
+      break;
+    iters *= 2;
+  }
+  iters = iters * (BENCH_MSEC * 1e6 / 10) / t * 10;
+  if (iters < 1)
+    iters = 1;
+
+  for (run = 0; run < BENCH_RUNS; run++) {
+    unsigned long a0 = allocs;
+    t = now_ns ();
+    fn (iters);
+    t = (now_ns () - t) / iters;
+    if (run == 0 || t < best) {
+      best = t;
+      a = allocs - a0;
+    }
+  }
+  printf ("%-32s %12.1f ns/op %10.2f allocs/op\n", name, best,
+	  (double) a / iters);
+}
+
+/* cksum */
+
+static packet_t bench_pkt;
+
+static void
+bench_cksum (long n)
+{
+  while (n-- > 0)
+    sink += cksum (&bench_pkt, sizeof (bench_pkt));
+}
+
+static void
+bench_cksum_copy (long n)
+{
+  static packet_t wire;
+
+  while (n-- > 0)
+    sink += cksum_fold (cksum_copy (0, &wire, &bench_pkt, sizeof (bench_pkt)));
+}
+
+/* addrhash, addreq */
+
+static struct sockaddr_storage addr4[2], addr6[2];
+
+static void
+make_addrs (void)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *) &addr4[0];
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addr6[0];
+
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons (9999);
+  sin->sin_addr.s_addr = htonl (0x7f000001);
+  addr4[1] = addr4[0];
+
+  sin6->sin6_family = AF_INET6;
+  sin6->sin6_port = htons (9999);
+  sin6->sin6_addr = in6addr_loopback;
+  addr6[1] = addr6[0];
+}
+
+static void
+bench_addrhash4 (long n)
+{
+  while (n-- > 0)
+    sink += addrhash (&addr4[0]);
+}
+
+static void
+bench_addrhash6 (long n)
+{
+  while (n-- > 0)
+    sink += addrhash (&addr6[0]);
+}
+
+static void
+bench_addreq4 (long n)
+{
+  while (n-- > 0)
+    sink += addreq (&addr4[0], &addr4[1]);
+}
+
+static void
+bench_addreq6 (long n)
+{
+  while (n-- > 0)
+    sink += addreq (&addr6[0], &addr6[1]);
+}
+
+/* Connections that own no descriptors: conn_free's close calls just
+ * fail with EBADF. */
+static conn_t *
+fake_conn (void)
+{
+  conn_t *c = conn_alloc ();
+  c->rfd = c->wfd = c->nfd = -1;
+  c->server = 1;
+  return c;
+}
+
+/* conn_bufspace, with depth chunks queued */
+
+static conn_t *bufspace_conn;
+
+static void
+queue_chunks (conn_t *c, int depth)
+{
+  while (depth-- > 0) {
+    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[16]));
+    ch->next = NULL;
+    ch->size = 16;
+    ch->used = 0;
+    *c->outqtail = ch;
+    c->outqtail = &ch->next;
+  }
+}
+
+static void
+bench_bufspace (long n)
+{
+  while (n-- > 0)
+    sink += conn_bufspace (bufspace_conn);
+}
+
+/* conn_mkevents */
+
+static void
+bench_mkevents (long n)
+{
+  while (n-- > 0)
+    conn_mkevents ();
+}
+
+/* conn_output / conn_drain through a pipe */
+
+static conn_t *out_conn;
+static int out_pipe[2];
+static char out_buf[500];
+
+/* The pipe has room: conn_output writes straight through */
+static void
+bench_output_direct (long n)
+{
+  char buf[sizeof (out_buf)];
+  while (n-- > 0) {
+    conn_output (out_conn, out_buf, sizeof (out_buf));
+    sink += read (out_pipe[0], buf, sizeof (buf));
+  }
+}
+
+/* The pipe is full: conn_output queues, conn_drain writes it later */
+static void
+bench_output_drain (long n)
+{
+  char buf[sizeof (out_buf)];
+  while (n-- > 0) {
+    conn_output (out_conn, out_buf, sizeof (out_buf));
+    sink += read (out_pipe[0], buf, sizeof (buf));
+    conn_drain (out_conn);
+  }
+}
+
+static void
+free_conns (void)
+{
+  while (loop->conn_list)
+    conn_free (loop->conn_list);
+}
+
+int
+main (int argc, char **argv)
+{
+  static const int depths[] = { 0, 1, 16, 256 };
+  static const int counts[] = { 10, 1000, 100000 };
+  struct config_common cc = { .window = 1, .timeout = 2000 };
+  char name[64];
+  size_t i;
+  int j;
+
+  progname = "microbench";
+  rel_loop_new (&cc, NULL);
+  for (j = 0; j < (int) sizeof (bench_pkt); j++)
+    ((unsigned char *) &bench_pkt)[j] = j * 7;
+  make_addrs ();
+
+  bench ("cksum (512 bytes)", bench_cksum);
+  bench ("cksum_copy (512 bytes)", bench_cksum_copy);
+  bench ("addrhash (IPv4)", bench_addrhash4);
+  bench ("addrhash (IPv6)", bench_addrhash6);
+  bench ("addreq (IPv4)", bench_addreq4);
+  bench ("addreq (IPv6)", bench_addreq6);
+
+  for (i = 0; i < sizeof (depths) / sizeof (depths[0]); i++) {
+    bufspace_conn = fake_conn ();
+    queue_chunks (bufspace_conn, depths[i]);
+    snprintf (name, sizeof (name), "conn_bufspace (%d queued)", depths[i]);
+    bench (name, bench_bufspace);
+    free_conns ();
+  }
+
+  for (i = 0; i < sizeof (counts) / sizeof (counts[0]); i++) {
+    for (j = 0; j < counts[i]; j++)
+      fake_conn ();
+    snprintf (name, sizeof (name), "conn_mkevents (%d conns)", counts[i]);
+    bench (name, bench_mkevents);
+    free_conns ();
+  }
+
+  if (pipe (out_pipe) < 0) {
+    perror ("pipe");
+    return 1;
+  }
+  make_async (out_pipe[0]);
+  make_async (out_pipe[1]);
+  out_conn = fake_conn ();
+  out_conn->wfd = out_pipe[1];
+  bench ("conn_output (direct)", bench_output_direct);
+  /* Fill the pipe, so that every conn_output has to queue */
+  while (write (out_pipe[1], out_buf, sizeof (out_buf)) > 0)
+    ;
+  bench ("conn_output + conn_drain", bench_output_drain);
+  out_conn->wfd = -1;
+  free_conns ();
+
+  return 0;
+}
@@ -12,18 +12,20 @@
 #include <sys/uio.h>
 #include <netinet/in.h>
 #include "rlib.h"
+#include "fec.h"
+#include "lz.h"
+#include "trace.h"
 
-/*Define state of client side and server side*/
+/*Define state of client side*/
 
-#define WAITING_INPUT_DATA             0          
-#define WAITING_ACK_PACKET             1
-#define WAITING_EOF_ACK_PACKET         2
+#define WAITING_INPUT_DATA             0          //input still open, send while the window allows
+#define WAITING_EOF_ACK_PACKET         2          //EOF sent, waiting for everything to be acked
 #define CLIENT_END_CONNECTION          3
 
 
 /*Define state of server side*/
 #define WAITING_PACKET                 4
-#define WAITING_BUFFER_AVAILABLE       5 
+#define WAITING_BUFFER_AVAILABLE       5
 #define SERVER_END_CONNECTION          6
 
 
@@ -33,70 +35,315 @@
 #define MAX_DATA_HEADER_PACKET_SIZE    512
 #define MIN_DATA_PACKET_SIZE           12
 #define EOF_PACKET_SIZE                12
+#define FLAGS_OPTION_SIZE              4
+#define TIMESTAMP_OPTION_SIZE          8
+
+/*The flags option is carried by every packet if -F, -Z, -P or -K is on*/
+#define FLAGS_IN_USE(cc)               ((cc)->fec || (cc)->compress || (cc)->deadline || (cc)->cookies)
+
+/*Packets delivered to conn_output with one writev*/
+#define DELIVER_IOV_MAX                64
+
+
+/*Bounds of the adaptive retransmission timeout (milliseconds)*/
+#define MIN_RTO                        200
+#define MAX_RTO                        60000
+
+
+/*Options. They are carried right after the fixed header of every
+  packet : after ackno in Ack packets, after seqno in Data packets, and
+  only when enabled on both ends. In this order :
+
+  - flags (-F, -Z, -P or -K) : 32-bit word, see FLAG_* below.
+  - timestamp (-T) : see struct timestamp_option.
+
+  All option fields are in network byte order.*/
+
+/*Flags option bits*/
+#define FLAG_FEC_DATA                  0x80000000   //Data packet which is a member of an FEC group
+#define FLAG_FEC_PARITY                0x40000000   //XOR parity of an FEC group, seqno is the group base
+#define FLAG_LZ                        0x20000000   //Data packet whose payload is compressed (lz.h)
+#define FLAG_LZ_OK                     0x10000000   //the sender of this packet expands FLAG_LZ payloads
+#define FLAG_FORWARD                   0x08000000   //No payload : the sender gave up on every seqno
+                                                    //before this one that is still missing (-P)
+#define FLAG_COOKIE                    0x04000000   //Payload is an admission cookie (-K) : from the
+                                                    //server with seqno 0, back from the client with 1
+#define FLAG_FEC_COUNT                 0x000000ff   //Data : index in group. Parity : group size.
+                                                    //Ack : packets rebuilt by the receiver (mod 256)
+
+/*Timestamp option. Both fields are microseconds of the sender's
+  CLOCK_REALTIME.*/
+struct timestamp_option {
+  uint32_t tsval;                 //time this copy of the packet was sent
+  uint32_t tsecr;                 //tsval of the last packet received from peer
+};
+
+
+/*Adaptive FEC group size : the loss rate is sampled every
+  FEC_LOSS_PERIOD new Data packets*/
+#define FEC_LOSS_PERIOD                64
+#define FEC_INITIAL_LOSS               (FEC_LOSS_ONE / 32)
+
+
+/*Compression (-Z) : once the peer has set FLAG_LZ_OK, input is gathered
+  up to LZ_INPUT_MAX bytes and as much of it as compresses into one
+  payload goes out. Payloads that do not shrink go out as they are, and
+  compression is not tried again for a number of packets that doubles
+  with every failure*/
+#define LZ_INPUT_MAX                   4096
+#define LZ_MAX_BACKOFF                 64
+
+
+/*Message mode (-P) : each line of input, or each maxPayload bytes of a
+  longer one, is a message sent in a Data packet of its own. A message
+  not acked cc->deadline msec after its first transmission is not
+  retransmitted anymore; once the oldest packets in flight have all
+  expired, a FLAG_FORWARD packet tells the receiver to stop waiting for
+  them. It is sent again every RTO until the Acks move past it*/
+
+
+/*Admission (-K) : the server keeps no state for a new peer until the
+  peer has shown that it gets what is sent to its address. Its first
+  Data packet (seqno 1) is only answered with a cookie, which holds the
+  time and a MAC of its address (addrmac). The connection is created
+  when the cookie comes back, no more than two COOKIE_EPOCH_MSEC
+  periods later and from the same address; the client sends seqno 1
+  again right behind it. A host is sent at most ADMIT_RATE cookies per
+  second (addr_ratelimit), and a connection whose seqno 1 has not come
+  HALF_OPEN_MSEC after its cookie is dropped*/
+#define COOKIE_SIZE                    8
+#define COOKIE_EPOCH_MSEC              5000
+#define ADMIT_RATE                     500
+#define HALF_OPEN_MSEC                 10000
+
+struct cookie {
+  uint32_t epoch;                 //nsec_now() / COOKIE_EPOCH_MSEC msec
+  uint32_t mac;                   //addrmac() of the peer, its stream and epoch
+};
+
+
+/*Auto-tuning (-A) : the send window follows the bandwidth-delay product,
+  measured once per RTT, and the output buffer the incoming rate*/
+#define AUTOTUNE_INITIAL_WINDOW        4
+#define AUTOTUNE_RCVBUF_MSEC           250        //output buffer holds this much of the incoming rate
+#define AUTOTUNE_RCV_PERIOD            100        //msec between receive rate samples
 
 
 /*functions belonging to client side*/
 int check_packet_corrupted(packet_t *pkt, size_t n);
-void save_info_packet_last_sent_from_client(rel_t *ReliableState, packet_t *pkt, int pktLength);
+int can_send_data_packet(rel_t *ReliableState);
+void save_info_packet_last_sent_from_client(rel_t *ReliableState, packet_t *pkt, const void *payload);
 void restranmit_packet(rel_t *ReliableState);
-int get_time_last_transmission(rel_t *ReliableState);
-packet_t *create_data_packet(rel_t *ReliableState);
-int get_time_last_transmission();
+packet_t *create_data_packet(rel_t *ReliableState, const void **payload);
+size_t read_ahead(rel_t *ReliableState);
+int compress_input(rel_t *ReliableState, char *payload, uint32_t *flags);
+int message_input(rel_t *ReliableState, char *payload);
+packet_t *expand_payload(rel_t *ReliableState, packet_t *pkt, const void *data, size_t len);
+void send_data_packet(rel_t *ReliableState, uint64_t seqno);
+void send_parity_packet(rel_t *ReliableState);
+void send_forward_packet(rel_t *ReliableState, uint64_t seqno);
 void handle_ack_packet(rel_t *ReliableState, struct ack_packet *pkt);
+int handle_ackno(rel_t *ReliableState, uint32_t ackno);
+void update_rtt_estimate(rel_t *ReliableState, uint32_t tsecr);
+void update_loss_rate(rel_t *ReliableState);
+void autotune_window(rel_t *ReliableState);
+void autotune_buffer(rel_t *ReliableState, size_t bytes);
 
 
 /*Functions shared by both client and server*/
-void convert_packet_to_host_byte_order(packet_t *pkt);
+void convert_packet_to_host_byte_order(rel_t *ReliableState, packet_t *pkt);
 void convert_packet_to_network_byte_order(packet_t *pkt);
+int options_length(const struct config_common *cc);
+char *get_options(rel_t *ReliableState, packet_t *pkt);
+uint32_t get_flags_option(rel_t *ReliableState, packet_t *pkt);
+void set_flags_option(rel_t *ReliableState, packet_t *pkt, uint32_t flags);
+uint32_t timestamp_now(void);
+uint64_t extend_seqno(uint64_t ref, uint32_t wire);
+uint64_t received_seqno(rel_t *ReliableState, uint32_t wire);
+uint32_t msec_now(void);
+uint64_t nsec_now(void);
+uint32_t timestamp_of(const struct timespec *ts);
+void set_timestamp_option(rel_t *ReliableState, struct timestamp_option *opt);
+struct timestamp_option *get_timestamp_option(rel_t *ReliableState, packet_t *pkt);
+int check_end_connection(rel_t *ReliableState);
+void print_stats(rel_t *ReliableState);
 
 /*Functions belonging to server side*/
-int make_buffer_available(rel_t *ReliableState);
 void handle_data_packet(rel_t *ReliableState, packet_t *pkt);
-void create_and_send_ack_packet(rel_t *ReliableState, uint32_t ackno);
-void save_info_packet_last_received_in_server(rel_t *ReliableState, packet_t *pkt);
+void handle_parity_packet(rel_t *ReliableState, packet_t *pkt, uint32_t flags);
+void handle_forward_packet(rel_t *ReliableState, packet_t *pkt);
+void handle_cookie_packet(rel_t *ReliableState, packet_t *pkt);
+int admit_peer(const struct config_common *cc, const struct sockaddr_storage *ss, packet_t *pkt);
+uint32_t cookie_mac(const struct sockaddr_storage *ss, uint32_t stream, uint32_t epoch);
+uint32_t cookie_epoch(void);
+void create_and_send_ack_packet(rel_t *ReliableState, uint64_t ackno);
+void acknowledge_data(rel_t *ReliableState, int delay);
+int buffer_data_packet(rel_t *ReliableState, packet_t *pkt, int force);
+void buffer_rebuilt_packet(rel_t *ReliableState, struct fec_lost *lost);
+void deliver_in_order(rel_t *ReliableState, packet_t *pkt);
+packet_t *next_in_order(rel_t *ReliableState, packet_t *pkt, uint64_t seqno);
+size_t output_data_in_server(rel_t *ReliableState, struct iovec *iov, int count);
+
+/*Connection table*/
+uint32_t alloc_connection_id(rel_t *ReliableState);
+void release_connection_id(uint32_t id);
+uint32_t peer_hash(const struct sockaddr_storage *ss, uint32_t stream);
+rel_t *lookup_connection(const struct sockaddr_storage *ss, uint32_t stream);
+void insert_connection(rel_t *ReliableState);
+void remove_connection(rel_t *ReliableState);
 
 
 /*Declate struct for client side*/
 typedef struct clientSide{
-  int clientState;                          //State of client side
-  uint32_t SeqnoPrevSent;                   //Used to number packets sent
-  struct timeval lastTranmissionTime;       //timeout for retransmission
-  
-  // both of these field used for parameter for function conn_sendpkt();
-  
-  size_t lenLastPacketSent;               // save length of packet sent in previous time
-  packet_t *pkt;                            //save a copy of previous packet
+  uint8_t clientState;                      //State of client side
+  uint64_t SeqnoPrevSent;                   //Used to number packets sent
+  uint64_t SeqnoLastAcked;                  //everything up to this seqno is acked
+  uint32_t sendWnd;                         //packets allowed in flight, cc->window unless auto-tuned
 }clientSide;
 
 
 /*Declare struct for server side*/
 typedef struct serverSide {
-  int serverState;
-  uint32_t SeqnoPrevReceived;             //field to save seqno received in server side.
+  uint8_t serverState;
+  uint8_t ackPending;                     //an Ack is owed and no Data packet has carried it yet
+  uint8_t halfOpen;                       //admitted with a cookie (-K), seqno 1 not in yet
+  uint64_t SeqnoPrevReceived;             //everything up to this seqno went to conn_output
+  uint32_t tsRecent;                      //tsval of the copy being acknowledged, echoed back as tsecr
+}serverSide;
 
-  /*Both of these field used for flow control*/
-  uint32_t sizeDataPacketReceived;
-  packet_t *pkt;
-  char output[MAX_DATA_PACKET_SIZE];
-  uint32_t numberByteRemainingMustBeFlushed;
 
-}serverSide;
+/*Per-packet ("hot") state of a connection. All of it lives in one dense
+  array indexed by connection ID, so rel_timer and the demultiplexer walk
+  contiguous memory and an idle connection costs only a few dozen bytes.*/
+typedef struct relHot {
+  rel_t *rel;         /*cold part of the connection, NULL if the slot is free*/
+
+  serverSide server;
+  clientSide client;
+
+  /*Timestamp option and RTT estimation (RFC 6298)*/
+  int32_t rto;        /*current retransmission timeout, in milliseconds*/
+  uint32_t srtt;      /*smoothed round trip time, in microseconds*/
+  uint32_t rttvar;    /*round trip time variation, in microseconds*/
+  uint32_t rttSamples;
+}relHot;
+
+/*The tables below are per thread : a thread running an rlib loop of its
+  own (librel.h) only sees its own connections in rel_timer and rel_demux*/
+static __thread relHot *relTable;            /*hot state, indexed by connection ID*/
+static __thread uint32_t relTableSize;       /*slots allocated*/
+static __thread uint32_t relTableUsed;       /*slots [0, relTableUsed) have been handed out*/
+static __thread uint32_t *relFreeIds;        /*stack of IDs released by rel_destroy*/
+static __thread uint32_t relFreeCount;
+
+#define HOT(r)   (&relTable[(r)->id])
+
+
+/*Server side demultiplexing : connections hashed by peer address*/
+static __thread rel_t **relHash;
+static __thread uint32_t relHashSize;        /*always a power of 2*/
+static __thread uint32_t relHashCount;
+
+
+/*A Data packet sent but not acknowledged yet*/
+typedef struct sentPacket {
+  packet_t *pkt;                    /*host byte order copy, NULL if the slot is free*/
+  const void *payload;              /*in the input mapping (-f), NULL if it follows the
+                                      header in pkt. pkt is then the header only*/
+  uint32_t sentTime;                /*msec_now() at last (re)transmission*/
+  uint8_t path;                     /*path it went out on last (-m)*/
+  uint8_t retransmitted;            /*its Ack is no RTT sample (Karn)*/
+  uint8_t expires;                  /*a message (-P), given up on at deadline*/
+  uint8_t expired;                  /*deadline passed, not sent anymore*/
+  uint32_t deadline;                /*msec_now() at which it expires*/
+}sentPacket;
+
+
+/*Counters shown by print_stats*/
+typedef struct relStats {
+  uint32_t dataSent;                /*Data packets, first transmissions*/
+  uint32_t retransmitted;
+  uint32_t dataReceived;
+  uint32_t acksSent;                /*standalone Ack packets*/
+  uint32_t acksPiggybacked;         /*Acks carried by Data packets instead*/
+  uint32_t paritySent;
+  uint32_t repaired;                /*lost Data packets rebuilt from parity*/
+  uint64_t bytesSent;               /*Data packet bytes, first transmissions*/
+  uint64_t parityBytes;
+  uint64_t lzIn;                    /*input bytes sent compressed*/
+  uint64_t lzOut;                   /*what they compressed to*/
+  uint64_t lzNsec;                  /*time spent compressing*/
+  uint32_t lzRaw;                   /*packets sent uncompressed*/
+  uint64_t unlzOut;                 /*bytes expanded from compressed payloads*/
+  uint64_t unlzNsec;
+  uint32_t expired;                 /*messages given up on (-P)*/
+  uint32_t forwardSent;
+  uint32_t skipped;                 /*seqnos the peer gave up on, never delivered*/
+  uint32_t poolDropped;             /*out of order packets the pool had no room for (-G)*/
+}relStats;
+
 
 struct reliable_state {
-  rel_t *next;      /* Linked list for traversing all connections */
-  rel_t **prev;
+  rel_t *hashNext;    /* Chain in relHash (server only) */
 
   conn_t *c;      /* This is the connection object */
 
   /* Add your own data fields below this */
-  int timeout;        /*Tells you what your retransmission timer should be,
-                  in milliseconds.*/
-
-  serverSide server;
-  clientSide client;
-
+  const struct config_common *cc;   /*timeout, timer, window and options, shared by all connections*/
+  uint32_t id;                      /*index of the hot state in relTable*/
+  uint32_t peerHash;                /*peer_hash() of the peer, if hashed*/
+  uint8_t hashed;                   /*in relHash (created by rel_demux)*/
+  uint8_t optlen;                   /*bytes of options after the fixed header*/
+  uint16_t maxPayload;              /*payload bytes per Data packet*/
+
+  /*Buffers, only allocated while data is in flight. Both windows have
+    cc->window slots, indexed by seqno % cc->window.*/
+  sentPacket *sendWindow;           /*packets not acked yet*/
+  packet_t **recvWindow;            /*packets received but not (fully) delivered yet*/
+  uint16_t recvBuffered;            /*packets in recvWindow*/
+  uint16_t deliveredBytes;          /*payload of the next packet already given to conn_output*/
+  uint8_t ackPath;                  /*path the last Data packet came in on, Acks go back on it*/
+
+  /*Forward error correction (-F)*/
+  struct fec_encoder *fecTx;        /*parity of the group being sent*/
+  struct fec_decoder *fecRx;        /*groups being received*/
+  uint32_t fecLossRate;             /*smoothed loss rate, FEC_LOSS_ONE = all lost*/
+  uint16_t fecK;                    /*size of the next group*/
+  uint16_t lossPeriodSent;
+  uint16_t lossPeriodLost;
+  uint8_t peerRepaired;             /*last rebuilt counter seen in the peer's Acks*/
+
+  /*Input read ahead of the packets it goes into (-Z, -P), LZ_INPUT_MAX bytes*/
+  uint8_t *inBuf;
+  uint16_t inStart;
+  uint16_t inEnd;
+  uint8_t inEof;                    /*conn_input is done, what is left is in inBuf*/
+
+  /*Compression (-Z)*/
+  uint8_t peerLz;                   /*peer has set FLAG_LZ_OK*/
+  uint16_t lzSkip;                  /*packets to send as they are before trying again*/
+  uint16_t lzBackoff;
+
+  uint8_t lastFull;                 /*last Data packet was as full as the input allowed*/
+  uint32_t admitTime;               /*msec_now() when admitted with a cookie (-K)*/
+
+  /*Message mode (-P)*/
+  uint64_t forwardSeqno;            /*last FLAG_FORWARD sent, 0 if none*/
+  uint32_t forwardTime;             /*msec_now() when it was sent*/
+  uint64_t skipBefore;              /*seqnos below this that are missing are not coming*/
+
+  /*Auto-tuning (-A)*/
+  uint32_t rateStart;               /*msec_now() when the current send rate sample began*/
+  uint32_t rateBytes;               /*bytes acked since*/
+  uint32_t deliveryRate;            /*smoothed, bytes per second*/
+  uint32_t tuneRtt;                 /*own RTT estimate in usec, used without -T*/
+  uint32_t rcvStart;                /*same, for the receive rate*/
+  uint32_t rcvBytes;
+  uint32_t rcvRate;
+  uint32_t bufSize;                 /*output buffer granted by rlib*/
+
+  relStats stats;
 };
-rel_t *rel_list;
 
 
 
@@ -124,24 +371,42 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
   }
 
   r->c = c;
-  r->next = rel_list;
-  r->prev = &rel_list;
-  if (rel_list)
-    rel_list->prev = &r->next;
-  rel_list = r;
 
   /* Do any other initialization you need here */
 
-  r->timeout = cc->timeout;
+  r->cc = cc;
+  r->optlen = options_length(cc);
+  r->maxPayload = MAX_DATA_PACKET_SIZE - r->optlen;
+  if (cc->fec) {
+    /*room for the length prefix of the parity*/
+    r->maxPayload -= 2;
+    r->fecLossRate = FEC_INITIAL_LOSS;
+    r->fecK = fec_choose_k(r->fecLossRate);
+  }
+  r->id = alloc_connection_id(r);
+
+  relHot *h = HOT(r);
+  h->rto = cc->timeout;
+
+  h->client.clientState = WAITING_INPUT_DATA;
+  h->client.SeqnoPrevSent = 0;
+  h->client.SeqnoLastAcked = 0;
+  h->client.sendWnd = cc->window;
+  if(cc->autotune){
+    if(h->client.sendWnd > AUTOTUNE_INITIAL_WINDOW){
+      h->client.sendWnd = AUTOTUNE_INITIAL_WINDOW;
+    }
+    r->rateStart = r->rcvStart = msec_now();
+    r->bufSize = 8192;
+  }
 
-  r->client.clientState = WAITING_INPUT_DATA;
-  r->client.SeqnoPrevSent = 0;
+  h->server.serverState = WAITING_PACKET;
+  h->server.SeqnoPrevReceived = 0;
 
-  
-  r->server.serverState = WAITING_PACKET;
-  r->server.SeqnoPrevReceived = 0;
-  r->server.sizeDataPacketReceived = 0;
-  r->server.numberByteRemainingMustBeFlushed = 0;
+  if (ss) {
+    r->peerHash = peer_hash (ss, conn_stream (c));
+    insert_connection (r);
+  }
 
   return r;
 }
@@ -149,12 +414,28 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 void
 rel_destroy (rel_t *r)
 {
-  if (r->next)
-    r->next->prev = r->prev;
-  *r->prev = r->next;
+  int i;
+
+  if (r->cc->stats)
+    print_stats (r);
+
+  if (r->hashed)
+    remove_connection (r);
+  release_connection_id (r->id);
   conn_destroy (r->c);
 
   /* Free any other allocated memory here */
+  for (i = 0; i < r->cc->window; i++) {
+    if (r->sendWindow)
+      free (r->sendWindow[i].pkt);
+    if (r->recvWindow && r->recvWindow[i])
+      conn_buffree (r->c, r->recvWindow[i], r->recvWindow[i]->len);
+  }
+  free(r->sendWindow);
+  free(r->recvWindow);
+  free(r->fecTx);
+  free(r->fecRx);
+  free(r->inBuf);
   free(r);
 }
 
@@ -172,6 +453,28 @@ rel_demux (const struct config_common *cc,
      const struct sockaddr_storage *ss,
      packet_t *pkt, size_t len)
 {
+  rel_t *r = lookup_connection (ss, pkt_rcvstream ());
+
+  if (!r) {
+    /*Only an intact Data packet with seqno 1 opens a connection*/
+    if (check_packet_corrupted (pkt, len)
+        || ntohs (pkt->len) < EOF_PACKET_SIZE + options_length (cc)
+        || ntohl (pkt->seqno) != 1)
+      return;
+    /*With -K, only once the cookie comes back*/
+    if (cc->cookies && !admit_peer (cc, ss, pkt))
+      return;
+
+    r = rel_create (NULL, ss, cc);
+    if (!r)
+      return;
+    if (cc->cookies) {
+      HOT(r)->server.halfOpen = 1;
+      r->admitTime = msec_now();
+    }
+  }
+
+  rel_recvpkt (r, pkt, len);
 }
 
 
@@ -182,55 +485,65 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
   /*check packet is corrupted or not */
   if(check_packet_corrupted(pkt,n)){
+    conn_trace(r->c, TRACE_DROP, n >= EOF_PACKET_SIZE ? ntohl(pkt->seqno) : 0,
+               n >= ACK_PACKET_SIZE ? ntohl(pkt->ackno) : 0, n);
     return;
   }
 
   /*Convert packet to host byte order*/
-  convert_packet_to_host_byte_order(pkt);
+  convert_packet_to_host_byte_order(r, pkt);
+  conn_trace(r->c, TRACE_RECV, pkt->len >= EOF_PACKET_SIZE + r->optlen ? pkt->seqno : 0,
+             pkt->ackno, pkt->len);
 
-  if(pkt->len == ACK_PACKET_SIZE){
-    handle_ack_packet(r,(struct ack_packet *) pkt);     //if receive ack knowdlege -> client 
+  /*Any packet may tell that the peer expands compressed payloads*/
+  if(r->cc->compress && (get_flags_option(r, pkt) & FLAG_LZ_OK)){
+    r->peerLz = 1;
   }
-  else{
+
+  if(pkt->len == ACK_PACKET_SIZE + r->optlen){
+    handle_ack_packet(r,(struct ack_packet *) pkt);     //if receive ack knowdlege -> client
+  }
+  else if(pkt->len >= EOF_PACKET_SIZE + r->optlen){
+    r->ackPath = pkt_rcvpath();
+    /*Data packets carry the peer's cumulative ack too*/
+    if(handle_ackno(r, pkt->ackno)){
+      return;
+    }
     handle_data_packet(r,pkt);    // if receive data packet : server
   }
 
 }
 
-/*client Get the data from "conn_input()" to transmit to the server*/
+/*client Get the data from "conn_input()" to transmit to the server, as
+  long as the window is open*/
 void
 rel_read (rel_t *s)
 {
   packet_t *pkt;
- 
+  const void *payload;
 
-  if(s->client.clientState == WAITING_INPUT_DATA)
+  /*conn_maysend last : it uses up the connection's turn (-Q)*/
+  while(HOT(s)->client.clientState == WAITING_INPUT_DATA && can_send_data_packet(s)
+        && conn_maysend(s->c))
   {
-    pkt = create_data_packet(s);
-    if(pkt != NULL){
-
-   /*preprocess before tranmission : converting packet to network byte order and compute checksum*/
-      int pktLength = pkt->len;    
-
-      if(pktLength == EOF_PACKET_SIZE){
-        s->client.clientState = WAITING_EOF_ACK_PACKET;
-      }else{
-        s->client.clientState = WAITING_ACK_PACKET;
-      }
-     //  prepare_for_transmission (pkt);
+    pkt = create_data_packet(s, &payload);
+    if(pkt == NULL){
+      break;
+    }
 
-     convert_packet_to_network_byte_order(pkt);
+    if(pkt->len == EOF_PACKET_SIZE + s->optlen){
+      HOT(s)->client.clientState = WAITING_EOF_ACK_PACKET;
+    }
 
-     memset (&(pkt->cksum), 0, sizeof (pkt->cksum));
-     pkt->cksum =cksum ((void*)pkt, pktLength);
+    /*Save infomation of the packet. The copy is kept until it is acknowledged*/
+    save_info_packet_last_sent_from_client(s, pkt, payload);
 
-     /*Send data packet to server*/
-     conn_sendpkt(s->c, pkt, (size_t)(pktLength));
-    
-    /*Save infomation of the packet*/  
-     save_info_packet_last_sent_from_client(s, pkt, pktLength);
+    /*Send data packet to server*/
+    send_data_packet(s, HOT(s)->client.SeqnoPrevSent);
 
-     free(pkt);
+    /*A group is closed when it is full, or when nothing more will come*/
+    if(s->fecTx && (s->fecTx->count >= s->fecK || HOT(s)->client.clientState != WAITING_INPUT_DATA)){
+      send_parity_packet(s);
     }
   }
 
@@ -242,11 +555,15 @@ server if buffer of server flush all data received in previous time to "conn_out
 void
 rel_output (rel_t *r)
 {
-  if(r->server.serverState == WAITING_BUFFER_AVAILABLE){
-    
-    if(make_buffer_available(r)){
-      create_and_send_ack_packet(r, r->server.SeqnoPrevReceived + 1);
-      r->server.serverState = WAITING_PACKET;
+  relHot *h = HOT(r);
+  uint64_t before = h->server.SeqnoPrevReceived;
+
+  if(h->server.serverState == WAITING_BUFFER_AVAILABLE){
+    deliver_in_order(r, NULL);
+
+    if(h->server.SeqnoPrevReceived != before){
+      acknowledge_data(r, 0);
+      check_end_connection(r);
     }
   }
 }
@@ -255,34 +572,60 @@ rel_output (rel_t *r)
 void
 rel_timer ()
 {
-  rel_t *ReliableState = rel_list;
-  
-  while(ReliableState){
-    restranmit_packet(ReliableState);
-    ReliableState = ReliableState->next;
+  uint32_t id;
+
+  for(id = 0; id < relTableUsed; id++){
+    /*Admitted, but the peer went no further*/
+    if(relTable[id].rel && relTable[id].server.halfOpen){
+      if(relTable[id].server.SeqnoPrevReceived > 0 || relTable[id].rel->recvBuffered){
+        relTable[id].server.halfOpen = 0;
+      }
+      else if(msec_now() - relTable[id].rel->admitTime > HALF_OPEN_MSEC){
+        rel_destroy(relTable[id].rel);
+        continue;
+      }
+    }
+    /*Only connections with packets in flight need their cold part*/
+    if(relTable[id].rel && relTable[id].client.SeqnoPrevSent != relTable[id].client.SeqnoLastAcked){
+      restranmit_packet(relTable[id].rel);
+    }
+    /*Delayed Ack no reply came to carry*/
+    if(relTable[id].rel && relTable[id].server.ackPending){
+      create_and_send_ack_packet(relTable[id].rel, relTable[id].server.SeqnoPrevReceived + 1);
+    }
+  }
+}
+
+/* Print the counters of every connection */
+void
+rel_stats ()
+{
+  uint32_t id;
+
+  for(id = 0; id < relTableUsed; id++){
+    if(relTable[id].rel){
+      print_stats(relTable[id].rel);
+    }
   }
 }
 
 
 
-/*Check packet is corrupted or not 
+/*Check packet is corrupted or not
 If 1 : packet is corrupted */
 int check_packet_corrupted(packet_t *pkt, size_t n)
 {
   int packet_length = (int) ntohs(pkt->len);
 
   /*If packet length is not enough, return*/
-  if(n < (size_t)packet_length){
+  if(n < ACK_PACKET_SIZE || n < (size_t)packet_length || packet_length < ACK_PACKET_SIZE){
     return 1;
   }
 
-  uint16_t checksum = pkt->cksum;
-  
-  /*Calculate checksum of packet received*/
-  memset (&(pkt->cksum), 0, sizeof (pkt->cksum));
-  uint16_t checksumCalculated = cksum((void*)pkt, packet_length);
-  
-  if(checksumCalculated != checksum)
+  /*Calculate checksum of packet received, as if its field were 0. The
+    packet is left as it is, so it can be checked again (rel_demux, then
+    rel_recvpkt); rlib may have summed it already while copying it in*/
+  if(pkt_rcvcksum(pkt, packet_length) != pkt->cksum)
     return 1;
 
   return 0;
@@ -290,12 +633,12 @@ int check_packet_corrupted(packet_t *pkt, size_t n)
 
 
 /*CHECK THIS LINK : https://www.ibm.com/support/knowledgecenter/en/SSB27U_6.4.0/com.ibm.zvm.v640.kiml0/asonetw.htm*/
-void convert_packet_to_host_byte_order(packet_t *pkt)
+void convert_packet_to_host_byte_order(rel_t *ReliableState, packet_t *pkt)
 {
   pkt->len = ntohs(pkt->len);
   pkt->ackno = ntohl(pkt->ackno);
 
-  if(pkt->len != ACK_PACKET_SIZE){
+  if(pkt->len >= EOF_PACKET_SIZE + ReliableState->optlen){
     pkt->seqno = ntohl(pkt->seqno);
   }
 }
@@ -322,194 +665,1416 @@ void convert_ack_packet_to_network_byte_order(struct ack_packet *pkt)
 /*Server side when receiving data_packet*/
 void handle_data_packet(rel_t *ReliableState, packet_t *pkt)
 {
-  if(pkt->seqno < ReliableState->server.SeqnoPrevReceived + 1){
-    create_and_send_ack_packet(ReliableState, pkt->seqno + 1);
-  }
-
-  if((ReliableState->server.serverState == WAITING_PACKET)  && (pkt->seqno == ReliableState->server.SeqnoPrevReceived + 1)){
-      
-      if(pkt->len == EOF_PACKET_SIZE){
-          conn_output(ReliableState->c, NULL, 0);
-          ReliableState->server.serverState = SERVER_END_CONNECTION;
-          create_and_send_ack_packet(ReliableState, pkt->seqno + 1);
-      
-        /*Just destroy connect when both client and servide reach to end state*/
-          if(ReliableState->client.clientState == CLIENT_END_CONNECTION){
-            rel_destroy(ReliableState);
-          }
-      }
-      
-      else{
-        /*flow controll : if buffer of receiver flushed all data received from client side in previous time*/
-        save_info_packet_last_received_in_server(ReliableState, pkt);
-
-        if(make_buffer_available(ReliableState)){
-          create_and_send_ack_packet(ReliableState, pkt->seqno + 1);
-          ReliableState->server.serverState = WAITING_PACKET;
-        }
-        else{
-          // ReliableState->server.serverState = WAITING_BUFFER_AVAILABLE;
-          // while(!make_buffer_available(ReliableState)){
-          //   make_buffer_available(ReliableState);
-          // }
-          ReliableState->server.serverState = WAITING_BUFFER_AVAILABLE;
-        }
-      }
+  relHot *h = HOT(ReliableState);
+  struct timestamp_option *opt = get_timestamp_option(ReliableState, pkt);
+  uint32_t flags = get_flags_option(ReliableState, pkt);
+  uint32_t window = ReliableState->cc->window;
+  struct fec_lost lost;
+  packet_t *plain = NULL;
+  uint64_t seqno;
+  int inOrder;
+
+  /*Not part of the stream, and its timestamp is none of the peer's*/
+  if(flags & FLAG_COOKIE){
+    handle_cookie_packet(ReliableState, pkt);
+    return;
+  }
+
+  seqno = received_seqno(ReliableState, pkt->seqno);
+
+  /*Remember which copy we are acknowledging, so the peer can time it.
+    As in RFC 7323 4.3, only up to the next packet expected (a parity
+    packet goes by its group, a forward by where it moves to), and never
+    an older copy : a late duplicate would make the peer's RTT look longer*/
+  if(opt && (seqno <= h->server.SeqnoPrevReceived + 1 || (flags & FLAG_FORWARD))
+     && (h->server.tsRecent == 0 || (int32_t)(ntohl(opt->tsval) - h->server.tsRecent) >= 0)){
+    h->server.tsRecent = ntohl(opt->tsval);
+  }
+
+  if(flags & FLAG_FEC_PARITY){
+    handle_parity_packet(ReliableState, pkt, flags);
+    return;
+  }
+  if(flags & FLAG_FORWARD){
+    handle_forward_packet(ReliableState, pkt);
+    return;
+  }
+
+  ReliableState->stats.dataReceived++;
+
+  /*Duplicate, or nothing more expected : just say where we are*/
+  if(seqno <= h->server.SeqnoPrevReceived || h->server.serverState == SERVER_END_CONNECTION){
+    acknowledge_data(ReliableState, 0);
+    return;
+  }
+
+  /*Beyond the window, or already buffered*/
+  if(seqno > h->server.SeqnoPrevReceived + window
+     || (ReliableState->recvWindow && ReliableState->recvWindow[seqno % window])){
+    acknowledge_data(ReliableState, 0);
+    return;
+  }
+
+  /*What goes to the application is what a compressed payload expands to*/
+  if(flags & FLAG_LZ){
+    plain = expand_payload(ReliableState, pkt, pkt->data + ReliableState->optlen,
+                           pkt->len - EOF_PACKET_SIZE - ReliableState->optlen);
+    if(!plain){
+      return;
+    }
+  }
+
+  /*First copy of this packet : account for it in its FEC group. Parity
+    covers the payloads as sent, FEC_MARK says which were compressed*/
+  if(flags & FLAG_FEC_DATA){
+    if(!ReliableState->fecRx){
+      ReliableState->fecRx = xmalloc(sizeof(*ReliableState->fecRx));
+      memset(ReliableState->fecRx, 0, sizeof(*ReliableState->fecRx));
+    }
+    if(fec_decoder_member(ReliableState->fecRx, seqno, flags & FLAG_FEC_COUNT,
+                          pkt->data + ReliableState->optlen,
+                          (pkt->len - EOF_PACKET_SIZE - ReliableState->optlen)
+                          | (flags & FLAG_LZ ? FEC_MARK : 0), &lost) == 1){
+      buffer_rebuilt_packet(ReliableState, &lost);
+    }
+  }
+
+  if(ReliableState->cc->autotune){
+    autotune_buffer(ReliableState, pkt->len);
+  }
+  if(plain){
+    pkt = plain;
+  }
+
+  /*The next packet in order is given to conn_output straight from here;
+    anything else waits in the receive window*/
+  inOrder = seqno == h->server.SeqnoPrevReceived + 1;
+  if(inOrder){
+    deliver_in_order(ReliableState, pkt);
+  }
+  else if(buffer_data_packet(ReliableState, pkt, 0)){
+    deliver_in_order(ReliableState, NULL);
+  }
+  else{
+    /*Not acked, so the sender tries again : the window closes to what
+      the pool can hold*/
+    ReliableState->stats.poolDropped++;
+  }
+  free(plain);
+
+  /*Only a plain in-order delivery may have its Ack delayed : gaps, flow
+    control and EOF are reported at once*/
+  acknowledge_data(ReliableState, inOrder && !ReliableState->recvWindow
+                   && h->server.serverState == WAITING_PACKET);
+  check_end_connection(ReliableState);
+}
+
+
+/*Parity of an FEC group : may rebuild a lost packet*/
+void handle_parity_packet(rel_t *ReliableState, packet_t *pkt, uint32_t flags)
+{
+  relHot *h = HOT(ReliableState);
+  uint64_t before = h->server.SeqnoPrevReceived;
+  struct fec_lost lost;
+
+  if(h->server.serverState == SERVER_END_CONNECTION){
+    return;
+  }
+
+  if(!ReliableState->fecRx){
+    ReliableState->fecRx = xmalloc(sizeof(*ReliableState->fecRx));
+    memset(ReliableState->fecRx, 0, sizeof(*ReliableState->fecRx));
+  }
+  if(fec_decoder_parity(ReliableState->fecRx, received_seqno(ReliableState, pkt->seqno),
+                        flags & FLAG_FEC_COUNT,
+                        pkt->data + ReliableState->optlen,
+                        pkt->len - EOF_PACKET_SIZE - ReliableState->optlen, &lost) != 1){
+    return;
+  }
+
+  buffer_rebuilt_packet(ReliableState, &lost);
+  deliver_in_order(ReliableState, NULL);
+
+  if(h->server.SeqnoPrevReceived != before){
+    acknowledge_data(ReliableState, 0);
+    check_end_connection(ReliableState);
+  }
+}
+
+
+/*The peer gave up on whatever is still missing before this seqno*/
+void handle_forward_packet(rel_t *ReliableState, packet_t *pkt)
+{
+  relHot *h = HOT(ReliableState);
+  uint64_t seqno = received_seqno(ReliableState, pkt->seqno);
+
+  if(h->server.serverState == SERVER_END_CONNECTION){
+    return;
+  }
+
+  if(seqno > ReliableState->skipBefore
+     && seqno <= h->server.SeqnoPrevReceived + ReliableState->cc->window + 1){
+    ReliableState->skipBefore = seqno;
+    deliver_in_order(ReliableState, NULL);
+  }
+  acknowledge_data(ReliableState, 0);
+  check_end_connection(ReliableState);
+}
+
+
+/*Client : the server wants its cookie back before it takes seqno 1
+  (-K). A server, which never asks for one, ignores copies of the
+  cookie its peer sent again*/
+void handle_cookie_packet(rel_t *ReliableState, packet_t *pkt)
+{
+  relHot *h = HOT(ReliableState);
+  packet_t wire;
+  int pktLength = EOF_PACKET_SIZE + ReliableState->optlen + COOKIE_SIZE;
+
+  if(ReliableState->hashed || pkt->len != pktLength
+     || h->client.SeqnoLastAcked != 0 || h->client.SeqnoPrevSent == 0){
+    return;
+  }
+
+  wire.len = pktLength;
+  wire.ackno = (uint32_t)(h->server.SeqnoPrevReceived + 1);
+  wire.seqno = 1;
+  set_flags_option(ReliableState, &wire, FLAG_COOKIE);
+  if(ReliableState->cc->timestamps){
+    set_timestamp_option(ReliableState, get_timestamp_option(ReliableState, &wire));
   }
+  memcpy(wire.data + ReliableState->optlen, pkt->data + ReliableState->optlen, COOKIE_SIZE);
+
+  convert_packet_to_network_byte_order(&wire);
+  memset (&(wire.cksum), 0, sizeof (wire.cksum));
+  wire.cksum = cksum ((void*)&wire, pktLength);
+  conn_sendpkt(ReliableState->c, &wire, (size_t)pktLength);
 
+  /*and seqno 1 right behind it, without waiting for the timer*/
+  send_data_packet(ReliableState, 1);
 }
 
+
+/*Server, no connection with the peer yet (-K) : 1 if pkt brings back a
+  good cookie. A first Data packet only gets one, if the peer's host
+  has not had too many already*/
+int admit_peer(const struct config_common *cc, const struct sockaddr_storage *ss, packet_t *pkt)
+{
+  int optlen = options_length(cc);
+  int pktLength = EOF_PACKET_SIZE + optlen + COOKIE_SIZE;
+  uint32_t stream = pkt_rcvstream();
+  uint32_t now = cookie_epoch();
+  struct cookie cookie;
+  uint32_t flags;
+  packet_t wire;
+
+  /*Flags come first in the options of Data packets*/
+  memcpy(&flags, pkt->data, sizeof(flags));
+  if(ntohl(flags) & FLAG_COOKIE){
+    if(ntohs(pkt->len) != pktLength){
+      return 0;
+    }
+    memcpy(&cookie, pkt->data + optlen, COOKIE_SIZE);
+    cookie.epoch = ntohl(cookie.epoch);
+    return (cookie.epoch == now || cookie.epoch + 1 == now)
+      && ntohl(cookie.mac) == cookie_mac(ss, stream, cookie.epoch);
+  }
+
+  if(!addr_ratelimit(ss, ADMIT_RATE)){
+    return 0;
+  }
+  cookie.epoch = htonl(now);
+  cookie.mac = htonl(cookie_mac(ss, stream, now));
+
+  /*A timestamp option, if any, stays 0 : nothing to echo*/
+  memset(&wire, 0, pktLength);
+  wire.len = htons(pktLength);
+  wire.ackno = htonl(1);
+  wire.seqno = htonl(0);
+  flags = htonl(FLAG_COOKIE);
+  memcpy(wire.data, &flags, sizeof(flags));
+  memcpy(wire.data + optlen, &cookie, COOKIE_SIZE);
+  wire.cksum = cksum((void*)&wire, pktLength);
+  pkt_reply(&wire, pktLength);
+  return 0;
+}
+
+
+uint32_t cookie_mac(const struct sockaddr_storage *ss, uint32_t stream, uint32_t epoch)
+{
+  return (uint32_t)addrmac(ss, 1, (uint64_t)stream << 32 | epoch);
+}
+
+
+uint32_t cookie_epoch(void)
+{
+  return (uint32_t)(nsec_now() / ((uint64_t)COOKIE_EPOCH_MSEC * 1000000));
+}
+
+
 void handle_ack_packet(rel_t *ReliableState, struct ack_packet *pkt)
 {
-  //Resend ack packet to client side
-  if(ReliableState->client.clientState == WAITING_ACK_PACKET){
-    
-    if(pkt->ackno == ReliableState->client.SeqnoPrevSent + 1){
-      ReliableState->client.clientState = WAITING_INPUT_DATA;
-      rel_read(ReliableState);
+  struct timestamp_option *opt = get_timestamp_option(ReliableState, (packet_t *)pkt);
+  relHot *h = HOT(ReliableState);
+  uint64_t ackno = extend_seqno(h->client.SeqnoLastAcked + 1, pkt->ackno);
+
+  /*The echoed timestamp says exactly which copy was acked, so an Ack
+    gives a valid sample even for retransmitted packets. Only one that
+    acks new data though (RFC 7323 4.1) : behind a hole the peer keeps
+    echoing the copy before it*/
+  if(opt && ackno > h->client.SeqnoLastAcked + 1 && ackno <= h->client.SeqnoPrevSent + 1){
+    update_rtt_estimate(ReliableState, ntohl(opt->tsecr));
+  }
+
+  /*Losses the peer repaired with parity count as losses too, or the
+    group size would grow back as soon as FEC starts working*/
+  if(ReliableState->cc->fec){
+    uint8_t repaired = get_flags_option(ReliableState, (packet_t *)pkt) & FLAG_FEC_COUNT;
+    ReliableState->lossPeriodLost += (uint8_t)(repaired - ReliableState->peerRepaired);
+    ReliableState->peerRepaired = repaired;
+  }
+
+  handle_ackno(ReliableState, pkt->ackno);
+}
+
+
+/*Cumulative ack : everything before ackno arrived. Comes from Ack
+  packets and from the Data packets of the other direction. Returns 1
+  if that ended the connection (ReliableState is gone)*/
+int handle_ackno(rel_t *ReliableState, uint32_t wireAckno)
+{
+  relHot *h = HOT(ReliableState);
+  uint32_t window = ReliableState->cc->window;
+  uint64_t ackno = extend_seqno(h->client.SeqnoLastAcked + 1, wireAckno);
+
+  if(ackno <= h->client.SeqnoLastAcked + 1 || ackno > h->client.SeqnoPrevSent + 1){
+    return 0;
+  }
+
+  while(h->client.SeqnoLastAcked + 1 < ackno){
+    sentPacket *slot;
+
+    h->client.SeqnoLastAcked++;
+    slot = &ReliableState->sendWindow[h->client.SeqnoLastAcked % window];
+    if(ReliableState->cc->autotune){
+      ReliableState->rateBytes += slot->pkt->len;
+      /*Without timestamps, time the newest packet acked, if it went out only once*/
+      if(h->client.SeqnoLastAcked + 1 == ackno && !slot->retransmitted && !ReliableState->cc->timestamps){
+        uint32_t rtt = (msec_now() - slot->sentTime) * 1000;
+        if(rtt == 0){
+          rtt = 1000;     /*below the resolution of sentTime*/
+        }
+        ReliableState->tuneRtt = ReliableState->tuneRtt ? (7 * ReliableState->tuneRtt + rtt) / 8 : rtt;
+      }
     }
+    free(slot->pkt);
+    slot->pkt = NULL;
   }
+  if(ReliableState->cc->autotune){
+    autotune_window(ReliableState);
+  }
+
+  if(h->client.SeqnoLastAcked == h->client.SeqnoPrevSent){
+    free(ReliableState->sendWindow);
+    ReliableState->sendWindow = NULL;
 
-  if(ReliableState->client.clientState == WAITING_EOF_ACK_PACKET){
-    if(pkt->ackno == ReliableState->client.SeqnoPrevSent + 1){
-      
-      ReliableState->client.clientState = CLIENT_END_CONNECTION;
-      
-      if(ReliableState->server.serverState == SERVER_END_CONNECTION){
-        
-        rel_destroy(ReliableState);
+    if(h->client.clientState == WAITING_EOF_ACK_PACKET){
+      h->client.clientState = CLIENT_END_CONNECTION;
+      if(check_end_connection(ReliableState)){
+        return 1;
       }
     }
   }
+
+  /*The window moved : send more*/
+  rel_read(ReliableState);
+  return 0;
 }
 
 
 /*Server side want to receive ack = SeqnoPrevReceived + 1*/
-void create_and_send_ack_packet(rel_t *ReliableState, uint32_t ackno)
+void create_and_send_ack_packet(rel_t *ReliableState, uint64_t ackno)
 {
-  struct ack_packet *ack_pkt;
-  ack_pkt = xmalloc(sizeof(*ack_pkt));
+  packet_t wire;
+  struct ack_packet *ack_pkt = (struct ack_packet *)&wire;
+
+  ack_pkt->len = (uint16_t)(ACK_PACKET_SIZE + ReliableState->optlen);
+  ack_pkt->ackno = (uint32_t)ackno;
 
-  ack_pkt->len = (uint16_t)ACK_PACKET_SIZE;
-  ack_pkt->ackno = ackno;              
- 
   int pktLength = ack_pkt->len;
 
+  /*Options follow ackno directly in Ack packets*/
+  set_flags_option(ReliableState, &wire, (ReliableState->stats.repaired & FLAG_FEC_COUNT)
+                   | (ReliableState->cc->compress ? FLAG_LZ_OK : 0));
+  if(ReliableState->cc->timestamps){
+    set_timestamp_option(ReliableState, get_timestamp_option(ReliableState, &wire));
+  }
+
   convert_ack_packet_to_network_byte_order (ack_pkt);
   memset (&(ack_pkt->cksum), 0, sizeof (ack_pkt->cksum));
   ack_pkt->cksum = cksum((void*)ack_pkt, pktLength);
 
-  conn_sendpkt(ReliableState->c, (packet_t *)ack_pkt, (size_t)pktLength);
-  free(ack_pkt);
+  conn_sendpkt_on(ReliableState->c, ReliableState->ackPath, &wire, (size_t)pktLength);
+  conn_trace(ReliableState->c, TRACE_SEND, 0, (uint32_t)ackno, pktLength);
+  HOT(ReliableState)->server.ackPending = 0;
+  ReliableState->stats.acksSent++;
+}
+
+
+/*The peer is owed an Ack. If there is data to send right now, the Ack
+  rides on it (send_data_packet stamps the current ackno); a separate
+  Ack packet only goes out when nothing else does.
+  With delay set and a window of more than one packet, the Ack of a
+  single packet may wait until the next rel_timer tick for a reply to
+  carry it (delayed Ack, RFC 1122); a second packet is acked at once*/
+void acknowledge_data(rel_t *ReliableState, int delay)
+{
+  relHot *h = HOT(ReliableState);
+  int owed = h->server.ackPending;
+
+  h->server.ackPending = 1;
+  if(h->client.clientState == WAITING_INPUT_DATA){
+    rel_read(ReliableState);
+  }
+  if(!h->server.ackPending){
+    return;
+  }
+  if(delay && !owed && ReliableState->cc->window > 1){
+    return;
+  }
+  create_and_send_ack_packet(ReliableState, h->server.SeqnoPrevReceived + 1);
+}
+
+
+/*Nagle-like rule from rlib.h : never more than one unacknowledged
+  packet smaller than the maximum in flight*/
+int can_send_data_packet(rel_t *ReliableState)
+{
+  relHot *h = HOT(ReliableState);
+
+  if(h->client.SeqnoPrevSent - h->client.SeqnoLastAcked >= h->client.sendWnd){
+    return 0;
+  }
+  if(h->client.SeqnoPrevSent == h->client.SeqnoLastAcked){
+    return 1;
+  }
+
+  return ReliableState->lastFull;
 }
 
 
-/*This function used for server side*/
-packet_t *create_data_packet(rel_t *ReliableState)
+/*This function used for server side. With input mapped in memory (-f),
+  the payload is not copied : *payload points to it in the mapping, and
+  only the header of the packet is allocated. Otherwise *payload is NULL*/
+packet_t *create_data_packet(rel_t *ReliableState, const void **payload)
 {
   packet_t *pkt;
-  pkt = xmalloc(sizeof(*pkt));
+  const void *data;
+  size_t header = EOF_PACKET_SIZE + ReliableState->optlen;
 
   int data_packet;
- 
-  /*Get input data from reliable site*/
-  data_packet = conn_input(ReliableState->c, pkt->data,  MAX_DATA_PACKET_SIZE);
-  if(data_packet == 0){
-    free(pkt);
-    return NULL;
+  uint32_t flags = ReliableState->cc->compress ? FLAG_LZ_OK : 0;
+
+  *payload = NULL;
+
+  /*Get input data from reliable site. Options, if any, go in front of the payload*/
+  if(conn_inputmapped(ReliableState->c) && !ReliableState->cc->deadline && !ReliableState->peerLz){
+    data_packet = conn_inputref(ReliableState->c, &data, ReliableState->maxPayload);
+    ReliableState->lastFull = data_packet == ReliableState->maxPayload;
+    if(data_packet == 0){
+      return NULL;
+    }
+    pkt = xmalloc(header);
+    if(data_packet > 0){
+      *payload = data;
+    }
+    else{
+      data = (char *)pkt + header;
+    }
+  }
+  else{
+    pkt = xmalloc(sizeof(*pkt));
+    data = pkt->data + ReliableState->optlen;
+    if(ReliableState->cc->deadline){
+      data_packet = message_input(ReliableState, pkt->data + ReliableState->optlen);
+    }
+    else if(ReliableState->peerLz){
+      data_packet = compress_input(ReliableState, pkt->data + ReliableState->optlen, &flags);
+    }
+    else{
+      data_packet = conn_input(ReliableState->c, pkt->data + ReliableState->optlen,
+                               ReliableState->maxPayload);
+      ReliableState->lastFull = data_packet == ReliableState->maxPayload;
+    }
+    if(data_packet == 0){
+      free(pkt);
+      return NULL;
+    }
   }
 
   /*if packet is EOF then len = 12 according to decription in rlib.h*/
   if(data_packet == -1){
-    pkt->len = (uint16_t)EOF_PACKET_SIZE;
+    data_packet = 0;
+  }
+  pkt->len = (uint16_t)(data_packet + EOF_PACKET_SIZE + ReliableState->optlen);
+
+  pkt->ackno = (uint32_t)1;       /*replaced by the current cumulative ack each time the
+                                  packet is sent, see send_data_packet*/
+
+  pkt->seqno = (uint32_t)(HOT(ReliableState)->client.SeqnoPrevSent + 1);    //this protocol just numbers packets
+
+  /*Add the packet to the parity of the current FEC group*/
+  if(ReliableState->cc->fec){
+    int index;
+
+    if(!ReliableState->fecTx){
+      ReliableState->fecTx = xmalloc(sizeof(*ReliableState->fecTx));
+      fec_encoder_start(ReliableState->fecTx, HOT(ReliableState)->client.SeqnoPrevSent + 1);
+    }
+    index = fec_encoder_add(ReliableState->fecTx, data,
+                            data_packet | (flags & FLAG_LZ ? FEC_MARK : 0));
+    flags |= FLAG_FEC_DATA | index;
+  }
+  set_flags_option(ReliableState, pkt, flags);
+
+  return pkt;
+}
+
+
+/*Top up inBuf from conn_input, moving what is left to the front once
+  it is past the middle. Returns the bytes in inBuf*/
+size_t read_ahead(rel_t *ReliableState)
+{
+  rel_t *r = ReliableState;
+  int n;
+
+  if(!r->inBuf){
+    r->inBuf = xmalloc(LZ_INPUT_MAX);
+  }
+
+  if(r->inStart > 0 && r->inEnd > LZ_INPUT_MAX / 2){
+    memmove(r->inBuf, r->inBuf + r->inStart, r->inEnd - r->inStart);
+    r->inEnd -= r->inStart;
+    r->inStart = 0;
+  }
+  while(!r->inEof && r->inEnd < LZ_INPUT_MAX){
+    n = conn_input(r->c, r->inBuf + r->inEnd, LZ_INPUT_MAX - r->inEnd);
+    if(n < 0){
+      r->inEof = 1;
+    }
+    if(n <= 0){
+      break;
+    }
+    r->inEnd += n;
+  }
+  return r->inEnd - r->inStart;
+}
+
+
+/*Payload of the next Data packet once the peer takes compressed data.
+  Returns like conn_input, and sets FLAG_LZ in flags if the payload is
+  compressed*/
+int compress_input(rel_t *ReliableState, char *payload, uint32_t *flags)
+{
+  rel_t *r = ReliableState;
+  size_t avail, out, consumed;
+  uint64_t start;
+
+  avail = read_ahead(r);
+  if(avail == 0){
+    return r->inEof ? -1 : 0;
+  }
+
+  if(r->lzSkip == 0){
+    start = nsec_now();
+    out = lz_compress(r->inBuf + r->inStart, avail, payload, r->maxPayload, &consumed);
+    r->stats.lzNsec += nsec_now() - start;
+    if(out < consumed){
+      r->lzBackoff = 0;
+      r->inStart += consumed;
+      r->stats.lzIn += consumed;
+      r->stats.lzOut += out;
+      /*full if it stopped for lack of room, or more input is waiting*/
+      r->lastFull = consumed < avail || r->inEnd == LZ_INPUT_MAX;
+      *flags |= FLAG_LZ;
+      return out;
+    }
+    r->lzBackoff = r->lzBackoff ? 2 * r->lzBackoff : 1;
+    if(r->lzBackoff > LZ_MAX_BACKOFF){
+      r->lzBackoff = LZ_MAX_BACKOFF;
+    }
+    r->lzSkip = r->lzBackoff;
   }
   else{
-    pkt->len = (uint16_t)(data_packet + EOF_PACKET_SIZE);
+    r->lzSkip--;
   }
 
-  pkt->ackno = (uint32_t)1;       /*set the ackno field to 1 as according to description in 
-                                  https://www.scs.stanford.edu/10au-cs144/lab/reliable/reliable.html*/
-  
-  pkt->seqno = (uint32_t)ReliableState->client.SeqnoPrevSent + 1;    //this protocol just numbers packets
+  out = avail < r->maxPayload ? avail : r->maxPayload;
+  memcpy(payload, r->inBuf + r->inStart, out);
+  r->inStart += out;
+  r->stats.lzRaw++;
+  r->lastFull = out == r->maxPayload;
+  return out;
+}
 
-  return pkt;
+
+/*Payload of the next Data packet in message mode : the next line of
+  input, with its newline, or as much of it as fits. A line is only
+  sent once it is complete, or when input ends. Returns like conn_input*/
+int message_input(rel_t *ReliableState, char *payload)
+{
+  rel_t *r = ReliableState;
+  size_t avail, len;
+  char *line, *end;
+
+  avail = read_ahead(r);
+  if(avail == 0){
+    return r->inEof ? -1 : 0;
+  }
+
+  line = (char *)r->inBuf + r->inStart;
+  len = avail < r->maxPayload ? avail : r->maxPayload;
+  end = memchr(line, '\n', len);
+  if(end){
+    len = end + 1 - line;
+  }
+  else if(len < r->maxPayload && !r->inEof){
+    return 0;
+  }
+
+  memcpy(payload, line, len);
+  r->inStart += len;
+  /*every message goes out at once, whatever its size*/
+  r->lastFull = 1;
+  return len;
 }
 
 
+/*Expand a compressed payload into a new packet with the header of pkt,
+  longer than a packet_t if need be. NULL if it does not decode*/
+packet_t *expand_payload(rel_t *ReliableState, packet_t *pkt, const void *data, size_t len)
+{
+  size_t header = EOF_PACKET_SIZE + ReliableState->optlen;
+  packet_t *plain = xmalloc(header + LZ_INPUT_MAX);
+  uint64_t start = nsec_now();
+  ssize_t n;
+
+  memcpy(plain, pkt, header);
+  n = lz_decompress(data, len, (char *)plain + header, LZ_INPUT_MAX);
+  if(n <= 0){
+    free(plain);
+    return NULL;
+  }
+  plain->len = header + n;
+  ReliableState->stats.unlzOut += n;
+  ReliableState->stats.unlzNsec += nsec_now() - start;
+  return plain;
+}
 
 
-/*Get info of packet send at previous time : clientside */
-void save_info_packet_last_sent_from_client(rel_t *ReliableState, packet_t *pkt, int pktLength)
+/*Stamp, checksum and transmit a packet of the send window. Used for
+  first transmission and retransmissions alike, so that the timestamp
+  always identifies the copy which is on the wire*/
+void send_data_packet(rel_t *ReliableState, uint64_t seqno)
 {
-  ReliableState->client.SeqnoPrevSent += 1;
-  ReliableState->client.pkt = pkt;
- // memcpy (&(ReliableState->client.pkt), (pkt), pktLength);
+  sentPacket *slot = &ReliableState->sendWindow[seqno % ReliableState->cc->window];
+  packet_t wire;
+  int pktLength = slot->pkt->len;
+  int header = EOF_PACKET_SIZE + ReliableState->optlen;
+  uint32_t sum;
+
+  uint32_t ackno = (uint32_t)(HOT(ReliableState)->server.SeqnoPrevReceived + 1);
+
+  /*Header only : the payload is copied below, as it is summed*/
+  memcpy(&wire, slot->pkt, header);
+  /*Piggyback the latest cumulative ack*/
+  wire.ackno = ackno;
+  if(HOT(ReliableState)->server.ackPending){
+    HOT(ReliableState)->server.ackPending = 0;
+    ReliableState->stats.acksPiggybacked++;
+  }
+  if(ReliableState->cc->timestamps){
+    set_timestamp_option(ReliableState, get_timestamp_option(ReliableState, &wire));
+  }
 
-  ReliableState->client.lenLastPacketSent = (size_t)pkt->len;
-  gettimeofday(&(ReliableState->client.lastTranmissionTime), NULL);   //use for retranmission
+  convert_packet_to_network_byte_order(&wire);
+  memset (&(wire.cksum), 0, sizeof (wire.cksum));
+  sum = cksum_add(0, &wire, header);
+  sum = cksum_copy(sum, (char *)&wire + header,
+                   slot->payload ? slot->payload : (char *)slot->pkt + header, pktLength - header);
+  wire.cksum = cksum_fold(sum);
+
+  conn_sendpkt(ReliableState->c, &wire, (size_t)pktLength);
+  conn_trace(ReliableState->c, TRACE_SEND, (uint32_t)seqno, ackno, pktLength);
+  slot->sentTime = msec_now();   //use for retranmission
+  slot->path = conn_lastpath(ReliableState->c);
 }
 
 
-/*Get info of packet received at previous time : server side */
-void save_info_packet_last_received_in_server(rel_t *ReliableState, packet_t *pkt)
+/*Close the current FEC group : send its parity. Parity packets are
+  never acked nor retransmitted.*/
+void send_parity_packet(rel_t *ReliableState)
 {
-  ReliableState->server.pkt = pkt;
-  uint16_t payload = pkt->len - MIN_DATA_PACKET_SIZE;
+  struct fec_encoder *e = ReliableState->fecTx;
+  packet_t wire;
+  int header = EOF_PACKET_SIZE + ReliableState->optlen;
+  int pktLength = header + e->acclen;
+  uint32_t sum;
+
+  wire.len = pktLength;
+  wire.ackno = (uint32_t)(HOT(ReliableState)->server.SeqnoPrevReceived + 1);
+  wire.seqno = (uint32_t)e->base;
+  set_flags_option(ReliableState, &wire, FLAG_FEC_PARITY | e->count
+                   | (ReliableState->cc->compress ? FLAG_LZ_OK : 0));
+  if(ReliableState->cc->timestamps){
+    set_timestamp_option(ReliableState, get_timestamp_option(ReliableState, &wire));
+  }
+
+  convert_packet_to_network_byte_order(&wire);
+  memset (&(wire.cksum), 0, sizeof (wire.cksum));
+  sum = cksum_add(0, &wire, header);
+  sum = cksum_copy(sum, wire.data + ReliableState->optlen, e->acc, e->acclen);
+  wire.cksum = cksum_fold(sum);
+
+  conn_sendpkt(ReliableState->c, &wire, (size_t)pktLength);
 
-  memcpy (&(ReliableState->server.output), (pkt->data), payload);
-  ReliableState->server.SeqnoPrevReceived = pkt->seqno;
-  ReliableState->server.sizeDataPacketReceived = payload;
-  ReliableState->server.numberByteRemainingMustBeFlushed = 0;
+  ReliableState->stats.paritySent++;
+  ReliableState->stats.parityBytes += pktLength;
+
+  free(e);
+  ReliableState->fecTx = NULL;
 }
 
-/*Flow control 
-  If return 1, buffer of server side flushed all data packet received from client in previous time.*/
-int make_buffer_available(rel_t *ReliableState){
+
+/*Tell the peer not to wait for anything missing before seqno. Not kept
+  in the send window : restranmit_packet sends it again until acked*/
+void send_forward_packet(rel_t *ReliableState, uint64_t seqno)
+{
+  packet_t wire;
+  int pktLength = EOF_PACKET_SIZE + ReliableState->optlen;
+
+  wire.len = pktLength;
+  wire.ackno = (uint32_t)(HOT(ReliableState)->server.SeqnoPrevReceived + 1);
+  wire.seqno = (uint32_t)seqno;
+  set_flags_option(ReliableState, &wire, FLAG_FORWARD
+                   | (ReliableState->cc->compress ? FLAG_LZ_OK : 0));
+  if(ReliableState->cc->timestamps){
+    set_timestamp_option(ReliableState, get_timestamp_option(ReliableState, &wire));
+  }
+
+  convert_packet_to_network_byte_order(&wire);
+  memset (&(wire.cksum), 0, sizeof (wire.cksum));
+  wire.cksum = cksum ((void*)&wire, pktLength);
+
+  conn_sendpkt(ReliableState->c, &wire, (size_t)pktLength);
+  conn_trace(ReliableState->c, TRACE_SEND, (uint32_t)seqno, ntohl(wire.ackno), pktLength);
+
+  ReliableState->forwardSeqno = seqno;
+  ReliableState->forwardTime = msec_now();
+  ReliableState->stats.forwardSent++;
+}
+
+
+
+
+/*Get info of packet send at previous time : clientside */
+void save_info_packet_last_sent_from_client(rel_t *ReliableState, packet_t *pkt, const void *payload)
+{
+  uint32_t window = ReliableState->cc->window;
+  sentPacket *slot;
+
+  if(!ReliableState->sendWindow){
+    ReliableState->sendWindow = xmalloc(window * sizeof(*ReliableState->sendWindow));
+    memset(ReliableState->sendWindow, 0, window * sizeof(*ReliableState->sendWindow));
+  }
+
+  HOT(ReliableState)->client.SeqnoPrevSent += 1;
+  slot = &ReliableState->sendWindow[HOT(ReliableState)->client.SeqnoPrevSent % window];
+  slot->pkt = pkt;
+  slot->payload = payload;
+  slot->retransmitted = 0;
+  /*EOF never expires*/
+  slot->expires = ReliableState->cc->deadline && pkt->len > EOF_PACKET_SIZE + ReliableState->optlen;
+  slot->expired = 0;
+  slot->deadline = msec_now() + ReliableState->cc->deadline;
+
+  ReliableState->stats.dataSent++;
+  ReliableState->stats.bytesSent += pkt->len;
+  if(ReliableState->cc->fec && ++ReliableState->lossPeriodSent >= FEC_LOSS_PERIOD){
+    update_loss_rate(ReliableState);
+  }
+}
+
+
+/*Hand count payloads to conn_output in a single writev, no more than
+  it has room for. Returns the number of bytes taken*/
+size_t output_data_in_server(rel_t *ReliableState, struct iovec *iov, int count)
+{
   size_t buffer_space = conn_bufspace(ReliableState->c);
-  if(buffer_space == 0){
+  size_t size = 0, clipped = 0;
+  int i, n;
+
+  for(i = 0; i < count && size < buffer_space; i++){
+    if(size + iov[i].iov_len > buffer_space){
+      clipped = size + iov[i].iov_len - buffer_space;
+      iov[i].iov_len -= clipped;
+    }
+    size += iov[i].iov_len;
+  }
+  if(size == 0){
     return 0;
   }
 
-  size_t byteLeft;
-  size_t gap_between_read_receive = ReliableState->server.sizeDataPacketReceived - ReliableState->server.numberByteRemainingMustBeFlushed;
-  if(gap_between_read_receive < buffer_space){
-    byteLeft = gap_between_read_receive;
-  }else{
-    byteLeft = buffer_space;
+  n = conn_outputv(ReliableState->c, iov, i);
+  /*the caller compares what was taken with the whole payloads*/
+  iov[i - 1].iov_len += clipped;
+  return n > 0 ? (size_t)n : 0;
+}
+
+
+/*The packet with this seqno if it arrived : from the receive window, or
+  pkt itself (just received, not buffered)*/
+packet_t *next_in_order(rel_t *ReliableState, packet_t *pkt, uint64_t seqno)
+{
+  packet_t *buffered = NULL;
+
+  if(ReliableState->recvWindow){
+    buffered = ReliableState->recvWindow[seqno % ReliableState->cc->window];
+  }
+  if(buffered && buffered->seqno == (uint32_t)seqno){
+    return buffered;
   }
+  if(pkt && pkt->seqno == (uint32_t)seqno){
+    return pkt;
+  }
+  return NULL;
+}
 
-  char *buffer = ReliableState->server.output;
-  uint16_t offset = ReliableState->server.numberByteRemainingMustBeFlushed;
-  int size_packet_output = conn_output(ReliableState->c , &buffer[offset], byteLeft);
-  
-  ReliableState->server.numberByteRemainingMustBeFlushed += size_packet_output;
-  /*Number of data read = number of data receive in buffer*/
-  if(ReliableState->server.numberByteRemainingMustBeFlushed == ReliableState->server.sizeDataPacketReceived){
-    return 1;
+
+/*Keep a copy of a packet in the receive window. The copy comes from
+  rlib's pool, which may turn it down when memory is tight (-G) unless
+  force is set. Returns 0 if it did*/
+int buffer_data_packet(rel_t *ReliableState, packet_t *pkt, int force)
+{
+  uint32_t window = ReliableState->cc->window;
+  packet_t *copy;
+
+  copy = conn_bufalloc(ReliableState->c, pkt->len, force);
+  if(!copy){
+    return 0;
+  }
+  if(!ReliableState->recvWindow){
+    ReliableState->recvWindow = xmalloc(window * sizeof(*ReliableState->recvWindow));
+    memset(ReliableState->recvWindow, 0, window * sizeof(*ReliableState->recvWindow));
+  }
+
+  memcpy(copy, pkt, pkt->len);
+  ReliableState->recvWindow[received_seqno(ReliableState, pkt->seqno) % window] = copy;
+  ReliableState->recvBuffered++;
+  return 1;
+}
+
+
+/*Put a packet rebuilt from parity in the receive window, as if it had
+  arrived*/
+void buffer_rebuilt_packet(rel_t *ReliableState, struct fec_lost *lost)
+{
+  relHot *h = HOT(ReliableState);
+  uint32_t window = ReliableState->cc->window;
+  size_t len = lost->len & ~FEC_MARK;
+  packet_t pkt, *plain;
+  int buffered;
+
+  if(lost->seqno <= h->server.SeqnoPrevReceived || lost->seqno > h->server.SeqnoPrevReceived + window
+     || len > ReliableState->maxPayload
+     || (ReliableState->recvWindow && ReliableState->recvWindow[lost->seqno % window])){
+    return;
+  }
+
+  pkt.len = EOF_PACKET_SIZE + ReliableState->optlen + len;
+  pkt.ackno = 1;
+  pkt.seqno = (uint32_t)lost->seqno;
+  memset(pkt.data, 0, ReliableState->optlen);
+  memcpy(pkt.data + ReliableState->optlen, lost->data, len);
+  if(lost->len & FEC_MARK){
+    plain = expand_payload(ReliableState, &pkt, lost->data, len);
+    if(!plain){
+      return;
+    }
+    buffered = buffer_data_packet(ReliableState, plain, 0);
+    free(plain);
+  }
+  else{
+    buffered = buffer_data_packet(ReliableState, &pkt, 0);
+  }
+
+  if(buffered){
+    ReliableState->stats.repaired++;
+  }
+}
+
+
+/*Deliver packets in sequence order, as far as conn_output takes them.
+  pkt, if not NULL, is the next packet in order; it is only copied into
+  the receive window if conn_output cannot take all of it.*/
+void deliver_in_order(rel_t *ReliableState, packet_t *pkt)
+{
+  relHot *h = HOT(ReliableState);
+  uint32_t window = ReliableState->cc->window;
+  struct iovec iov[DELIVER_IOV_MAX];
+  packet_t *run[DELIVER_IOV_MAX];
+  packet_t *next;
+  size_t written, taken;
+  int n, i;
+
+  while(h->server.serverState != SERVER_END_CONNECTION){
+    uint64_t seqno = h->server.SeqnoPrevReceived + 1;
+
+    /*Missing, and the peer gave up on it (-P)*/
+    if(seqno < ReliableState->skipBefore && !next_in_order(ReliableState, pkt, seqno)){
+      h->server.SeqnoPrevReceived = seqno;
+      ReliableState->stats.skipped++;
+      continue;
+    }
+
+    /*Gather the payloads of all the packets that are next in order, so
+      they reach the application in one writev straight from the packets*/
+    for(n = 0; n < DELIVER_IOV_MAX; n++){
+      uint16_t payload;
+
+      next = next_in_order(ReliableState, pkt, seqno + n);
+      if(!next){
+        break;
+      }
+      payload = next->len - EOF_PACKET_SIZE - ReliableState->optlen;
+      if(payload == 0){
+        break;                /*EOF, once the data before it is out*/
+      }
+      iov[n].iov_base = next->data + ReliableState->optlen;
+      iov[n].iov_len = payload;
+      if(n == 0){
+        iov[n].iov_base = (char *)iov[n].iov_base + ReliableState->deliveredBytes;
+        iov[n].iov_len -= ReliableState->deliveredBytes;
+      }
+      run[n] = next;
+    }
+
+    if(n == 0){
+      if(!next){
+        break;
+      }
+      conn_output(ReliableState->c, NULL, 0);
+      h->server.serverState = SERVER_END_CONNECTION;
+      run[n++] = next;
+      written = 0;
+      iov[0].iov_len = 0;
+    }
+    else{
+      written = output_data_in_server(ReliableState, iov, n);
+    }
+    taken = written;
+
+    /*flow controll : only ack packets whose whole payload went to conn_output*/
+    for(i = 0; i < n && written >= iov[i].iov_len; i++){
+      written -= iov[i].iov_len;
+      h->server.SeqnoPrevReceived = seqno + i;
+      ReliableState->deliveredBytes = 0;
+      if(run[i] != pkt){
+        ReliableState->recvWindow[(seqno + i) % window] = NULL;
+        ReliableState->recvBuffered--;
+        conn_buffree(ReliableState->c, run[i], run[i]->len);
+      }
+    }
+
+    if(i < n){
+      ReliableState->deliveredBytes += written;
+      for(; i < n; i++){
+        if(run[i] == pkt){
+          buffer_data_packet(ReliableState, pkt, 1);
+        }
+      }
+      /*Cut short by the room left rather than by conn_output : there is
+        no rel_output to wait for if it took everything*/
+      if(taken > 0 && conn_bufspace(ReliableState->c) > 0){
+        continue;
+      }
+      h->server.serverState = WAITING_BUFFER_AVAILABLE;
+      return;
+    }
+  }
+
+  if(h->server.serverState == WAITING_BUFFER_AVAILABLE){
+    h->server.serverState = WAITING_PACKET;
   }
 
+  if(ReliableState->recvWindow && ReliableState->recvBuffered == 0){
+    free(ReliableState->recvWindow);
+    ReliableState->recvWindow = NULL;
+  }
+  if(ReliableState->fecRx && !fec_decoder_retire(ReliableState->fecRx, h->server.SeqnoPrevReceived)){
+    free(ReliableState->fecRx);
+    ReliableState->fecRx = NULL;
+  }
+}
+
+
+/*Destroy the connection once both directions are done. If return 1, it
+  was destroyed.*/
+int check_end_connection(rel_t *ReliableState)
+{
+  relHot *h = HOT(ReliableState);
+
+  if(h->client.clientState == CLIENT_END_CONNECTION && h->server.serverState == SERVER_END_CONNECTION){
+    rel_destroy(ReliableState);
+    return 1;
+  }
   return 0;
 }
 
+
 /*Check timeout of packets. Retransmitting any packets which expire timeout*/
 void restranmit_packet(rel_t *ReliableState)
 {
-  if((ReliableState->client.clientState == WAITING_ACK_PACKET) || (ReliableState->client.clientState == WAITING_EOF_ACK_PACKET)){
-    
-    int time_last_transmission = get_time_last_transmission(ReliableState);
-    
-    if(time_last_transmission > ReliableState->timeout){
-        conn_sendpkt(ReliableState->c, (ReliableState->client.pkt), (ReliableState->client.lenLastPacketSent));       /////////
-        gettimeofday(&(ReliableState->client.lastTranmissionTime), NULL);
+  relHot *h = HOT(ReliableState);
+  uint32_t now = msec_now();
+  uint64_t seqno, forward;
+  int retransmitted = 0, rto;
+
+  for(seqno = h->client.SeqnoLastAcked + 1; seqno <= h->client.SeqnoPrevSent; seqno++){
+    sentPacket *slot = &ReliableState->sendWindow[seqno % ReliableState->cc->window];
+
+    if(slot->expires && !slot->expired && (int)(now - slot->deadline) >= 0){
+      slot->expired = 1;
+      ReliableState->stats.expired++;
+    }
+    if(slot->expired){
+      continue;
+    }
+    /*A message due before the RTO runs out gets its retry anyway : after
+      half the time it had left when it last went out*/
+    rto = h->rto;
+    if(slot->expires && (int)(slot->deadline - slot->sentTime) / 2 < rto){
+      rto = (int)(slot->deadline - slot->sentTime) / 2;
+    }
+    if((int)(now - slot->sentTime) > rto){
+      /*Tell rlib which path lost it, so that it gets fewer packets*/
+      conn_pathsample(ReliableState->c, slot->path, -1);
+      conn_trace(ReliableState->c, TRACE_RETRANSMIT, (uint32_t)seqno, 0, slot->pkt->len);
+      slot->retransmitted = 1;
+      send_data_packet(ReliableState, seqno);
+      ReliableState->stats.retransmitted++;
+      ReliableState->lossPeriodLost++;
+      retransmitted = 1;
     }
   }
+
+  /*Deadlines follow the seqnos, so what expired is the oldest part of
+    the window : have the receiver skip it*/
+  if(ReliableState->cc->deadline){
+    for(forward = h->client.SeqnoLastAcked + 1; forward <= h->client.SeqnoPrevSent; forward++){
+      if(!ReliableState->sendWindow[forward % ReliableState->cc->window].expired){
+        break;
+      }
+    }
+    if(forward > h->client.SeqnoLastAcked + 1
+       && (forward != ReliableState->forwardSeqno
+           || (int)(now - ReliableState->forwardTime) > h->rto)){
+      send_forward_packet(ReliableState, forward);
+    }
+  }
+
+  /*Exponential backoff, until an Ack brings a fresh RTT sample*/
+  if(retransmitted && ReliableState->cc->timestamps && h->rto < MAX_RTO){
+    h->rto *= 2;
+    if(h->rto > MAX_RTO)
+      h->rto = MAX_RTO;
+  }
 }
 
-/*Calculate the time between now and the time which transmit data packet*/
-int get_time_last_transmission(rel_t *ReliableState)
+/*Size the send window from the bandwidth-delay product. The rate is
+  sampled once per RTT; twice the BDP lets the window keep doubling
+  every RTT for as long as more packets in flight still mean more
+  throughput, and brings it back down when they do not*/
+void autotune_window(rel_t *ReliableState)
 {
-  struct timeval now;
-  gettimeofday(&now,NULL);
-  return (((int)now.tv_sec * 1000 + (int)now.tv_usec / 1000) - 
-    ((int)((ReliableState->client.lastTranmissionTime).tv_sec) * 1000 + (int)((ReliableState->client.lastTranmissionTime).tv_usec) / 1000));
+  relHot *h = HOT(ReliableState);
+  uint32_t now = msec_now();
+  uint32_t elapsed = now - ReliableState->rateStart;
+  uint32_t rtt = h->rttSamples ? h->srtt : ReliableState->tuneRtt;
+  uint32_t rate;
+  uint64_t wnd;
+
+  if(rtt == 0 || (uint64_t)elapsed * 1000 < rtt || elapsed == 0){
+    return;
+  }
+
+  rate = (uint32_t)((uint64_t)ReliableState->rateBytes * 1000 / elapsed);
+  ReliableState->deliveryRate = ReliableState->deliveryRate
+    ? (3 * (uint64_t)ReliableState->deliveryRate + rate) / 4 : rate;
+  ReliableState->rateBytes = 0;
+  ReliableState->rateStart = now;
+
+  wnd = 2 * (uint64_t)ReliableState->deliveryRate * rtt / 1000000 / ReliableState->maxPayload + 2;
+  if(wnd > (uint64_t)ReliableState->cc->window){
+    wnd = ReliableState->cc->window;
+  }
+  h->client.sendWnd = (uint32_t)wnd;
+}
+
+/*Size the output buffer to hold AUTOTUNE_RCVBUF_MSEC of the incoming
+  rate, so that a slow reader does not stop the acks at once. rlib may
+  grant less when memory is short*/
+void autotune_buffer(rel_t *ReliableState, size_t bytes)
+{
+  uint32_t now = msec_now();
+  uint32_t elapsed = now - ReliableState->rcvStart;
+  uint64_t want;
+
+  ReliableState->rcvBytes += bytes;
+  if(elapsed < AUTOTUNE_RCV_PERIOD){
+    return;
+  }
+
+  ReliableState->rcvRate = (uint32_t)((uint64_t)ReliableState->rcvBytes * 1000 / elapsed);
+  ReliableState->rcvBytes = 0;
+  ReliableState->rcvStart = now;
+
+  want = (uint64_t)ReliableState->rcvRate * AUTOTUNE_RCVBUF_MSEC / 1000;
+  if(want > ReliableState->cc->bufmax){
+    want = ReliableState->cc->bufmax;
+  }
+  ReliableState->bufSize = conn_setbufsize(ReliableState->c, (size_t)want);
+}
+
+/*Sequence numbers are 64-bit inside and 32-bit on the wire. A wire
+  value stands for the 64-bit number closest to ref (serial number
+  arithmetic, RFC 1982), which is unambiguous while both ends are
+  less than 2^31 packets apart -- always true, given the window.
+  Returns 0, which is never a valid seqno, for values before the start*/
+uint64_t extend_seqno(uint64_t ref, uint32_t wire)
+{
+  int32_t delta = (int32_t)(wire - (uint32_t)ref);
+
+  if(delta < 0 && (uint64_t)-(int64_t)delta > ref){
+    return 0;
+  }
+  return ref + delta;
+}
+
+/*Full seqno of a packet received, taken relative to the next one expected*/
+uint64_t received_seqno(rel_t *ReliableState, uint32_t wire)
+{
+  return extend_seqno(HOT(ReliableState)->server.SeqnoPrevReceived + 1, wire);
+}
+
+/*Milliseconds of CLOCK_MONOTONIC, truncated to 32 bits*/
+uint32_t msec_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)now.tv_sec * 1000 + (uint32_t)(now.tv_nsec / 1000000);
+}
+
+/*Nanoseconds of CLOCK_MONOTONIC, to measure CPU time spent*/
+uint64_t nsec_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*Sample the loss rate over the last FEC_LOSS_PERIOD packets and pick
+  the size of the next FEC groups from it*/
+void update_loss_rate(rel_t *ReliableState)
+{
+  uint32_t sample = (uint32_t)ReliableState->lossPeriodLost * FEC_LOSS_ONE / ReliableState->lossPeriodSent;
+
+  if(sample > FEC_LOSS_ONE){
+    sample = FEC_LOSS_ONE;
+  }
+  ReliableState->fecLossRate = (7 * ReliableState->fecLossRate + sample) / 8;
+  ReliableState->fecK = fec_choose_k(ReliableState->fecLossRate);
+  ReliableState->lossPeriodSent = 0;
+  ReliableState->lossPeriodLost = 0;
+}
+
+
+/*Bytes of options after the fixed header, for a given configuration*/
+int options_length(const struct config_common *cc)
+{
+  return (FLAGS_IN_USE(cc) ? FLAGS_OPTION_SIZE : 0) + (cc->timestamps ? TIMESTAMP_OPTION_SIZE : 0);
+}
+
+/*Start of the options of a packet (host byte order header)*/
+char *get_options(rel_t *ReliableState, packet_t *pkt)
+{
+  if(pkt->len == ACK_PACKET_SIZE + ReliableState->optlen){
+    return (char *)((struct ack_packet *)pkt + 1);
+  }
+  return pkt->data;
+}
+
+/*Flags option of a packet, 0 if flags are not in use*/
+uint32_t get_flags_option(rel_t *ReliableState, packet_t *pkt)
+{
+  uint32_t flags;
+
+  if(!FLAGS_IN_USE(ReliableState->cc)){
+    return 0;
+  }
+  memcpy(&flags, get_options(ReliableState, pkt), sizeof(flags));
+  return ntohl(flags);
+}
+
+/*pkt->len must already be set*/
+void set_flags_option(rel_t *ReliableState, packet_t *pkt, uint32_t flags)
+{
+  if(FLAGS_IN_USE(ReliableState->cc)){
+    flags = htonl(flags);
+    memcpy(get_options(ReliableState, pkt), &flags, sizeof(flags));
+  }
+}
+
+
+/*Timestamps are microseconds of CLOCK_REALTIME truncated to 32 bits, the
+  clock used by the kernel for SO_TIMESTAMPNS. Only differences of two
+  timestamps are meaningful.*/
+uint32_t timestamp_of(const struct timespec *ts)
+{
+  return (uint32_t)ts->tv_sec * 1000000 + (uint32_t)(ts->tv_nsec / 1000);
+}
+
+uint32_t timestamp_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return timestamp_of(&now);
+}
+
+/*Fill in the timestamp option of a packet about to be sent*/
+void set_timestamp_option(rel_t *ReliableState, struct timestamp_option *opt)
+{
+  opt->tsval = htonl(timestamp_now());
+  opt->tsecr = htonl(HOT(ReliableState)->server.tsRecent);
+}
+
+/*Return the timestamp option of a packet (host byte order header), or
+  NULL if timestamps are not in use on this connection*/
+struct timestamp_option *get_timestamp_option(rel_t *ReliableState, packet_t *pkt)
+{
+  if(!ReliableState->cc->timestamps){
+    return NULL;
+  }
+  return (struct timestamp_option *)(get_options(ReliableState, pkt) + (FLAGS_IN_USE(ReliableState->cc) ? FLAGS_OPTION_SIZE : 0));
+}
+
+/*Take an RTT sample from an echoed timestamp and recompute the
+  retransmission timeout as in RFC 6298. The arrival time comes from the
+  kernel (SO_TIMESTAMPNS) when available, so time the packet spent queued
+  before we got to it is not counted.*/
+void update_rtt_estimate(rel_t *ReliableState, uint32_t tsecr)
+{
+  relHot *h = HOT(ReliableState);
+  struct timespec arrival;
+  uint32_t rtt, delta, var;
+  int rto;
+
+  /*0 means the peer had nothing to echo yet*/
+  if(tsecr == 0){
+    return;
+  }
+
+  pkt_rcvtime(&arrival);
+  rtt = timestamp_of(&arrival) - tsecr;
+
+  /*Garbage (e.g. echo from a previous connection) : ignore*/
+  if(rtt > (uint32_t)MAX_RTO * 1000){
+    return;
+  }
+
+  /*The Ack came back on the path its Data went out on*/
+  conn_pathsample(ReliableState->c, pkt_rcvpath(), (long)rtt);
+
+  if(h->rttSamples == 0){
+    h->srtt = rtt;
+    h->rttvar = rtt / 2;
+  }
+  else{
+    delta = h->srtt > rtt ? h->srtt - rtt : rtt - h->srtt;
+    h->rttvar = (3 * h->rttvar + delta) / 4;
+    h->srtt = (7 * h->srtt + rtt) / 8;
+  }
+  h->rttSamples++;
+
+  /*The clock granularity here is the rel_timer period*/
+  var = 4 * h->rttvar;
+  if(var < (uint32_t)ReliableState->cc->timer * 1000){
+    var = (uint32_t)ReliableState->cc->timer * 1000;
+  }
+  rto = (int)((h->srtt + var) / 1000);
+
+  if(rto < MIN_RTO){
+    rto = MIN_RTO;
+  }
+  if(rto > MAX_RTO){
+    rto = MAX_RTO;
+  }
+  h->rto = rto;
+}
+
+
+/*One line of counters for a connection, on stderr*/
+void print_stats(rel_t *ReliableState)
+{
+  relHot *h = HOT(ReliableState);
+  relStats *st = &ReliableState->stats;
+
+  fprintf(stderr, "[conn %u] sent %u pkts (%llu bytes), retransmitted %u, received %u"
+          ", acks %u (+%u piggybacked)",
+          ReliableState->id, st->dataSent, (unsigned long long)st->bytesSent,
+          st->retransmitted, st->dataReceived, st->acksSent, st->acksPiggybacked);
+  if(ReliableState->cc->timestamps){
+    fprintf(stderr, ", srtt %u.%03u ms, rto %d ms", h->srtt / 1000, h->srtt % 1000, h->rto);
+  }
+  if(ReliableState->cc->autotune){
+    fprintf(stderr, ", window %u/%d, rate %u KB/s, buffer %u",
+            h->client.sendWnd, ReliableState->cc->window,
+            ReliableState->deliveryRate / 1024, ReliableState->bufSize);
+  }
+  if(ReliableState->cc->deadline){
+    fprintf(stderr, ", expired %u (%u forward), skipped %u",
+            st->expired, st->forwardSent, st->skipped);
+  }
+  if(ReliableState->cc->compress){
+    fprintf(stderr, ", lz %llu -> %llu bytes (%.2fx) in %.1f ms, %u raw, expanded %llu bytes in %.1f ms",
+            (unsigned long long)st->lzIn, (unsigned long long)st->lzOut,
+            st->lzOut ? (double)st->lzIn / st->lzOut : 1.0, st->lzNsec / 1e6, st->lzRaw,
+            (unsigned long long)st->unlzOut, st->unlzNsec / 1e6);
+  }
+  if(st->poolDropped){
+    fprintf(stderr, ", %u dropped for lack of memory", st->poolDropped);
+  }
+  if(ReliableState->cc->fec){
+    fprintf(stderr, ", parity %u (%.1f%% overhead), repaired %u, K %u, loss %.2f%%",
+            st->paritySent, st->bytesSent ? 100.0 * st->parityBytes / st->bytesSent : 0.0,
+            st->repaired, ReliableState->fecK, 100.0 * ReliableState->fecLossRate / FEC_LOSS_ONE);
+  }
+  fprintf(stderr, "\n");
+}
+
+
+/*Hand out the lowest free slot of relTable, growing it if needed*/
+uint32_t alloc_connection_id(rel_t *ReliableState)
+{
+  uint32_t id;
+
+  if(relFreeCount > 0){
+    id = relFreeIds[--relFreeCount];
+  }
+  else{
+    if(relTableUsed == relTableSize){
+      relTableSize = relTableSize ? 2 * relTableSize : 16;
+      relTable = realloc(relTable, relTableSize * sizeof(*relTable));
+      relFreeIds = realloc(relFreeIds, relTableSize * sizeof(*relFreeIds));
+      if(!relTable || !relFreeIds){
+        fprintf(stderr, "%s: out of memory growing connection table\n", progname);
+        abort();
+      }
+    }
+    id = relTableUsed++;
+  }
+
+  memset(&relTable[id], 0, sizeof(relTable[id]));
+  relTable[id].rel = ReliableState;
+  return id;
+}
+
+/*The tables go with the last connection : they are per thread, and a
+  thread may be gone by the time another connection would use them*/
+void release_connection_id(uint32_t id)
+{
+  relTable[id].rel = NULL;
+  relFreeIds[relFreeCount++] = id;
+  if(relFreeCount == relTableUsed){
+    free(relTable);
+    free(relFreeIds);
+    relTable = NULL;
+    relFreeIds = NULL;
+    relTableSize = relTableUsed = relFreeCount = 0;
+  }
+}
+
+/*A peer multiplexing several streams (-X) has a connection per stream*/
+uint32_t peer_hash(const struct sockaddr_storage *ss, uint32_t stream)
+{
+  return addrhash(ss) + stream * 0x9e3779b1;
+}
+
+/*Find the connection of a peer's stream in the server's hash table*/
+rel_t *lookup_connection(const struct sockaddr_storage *ss, uint32_t stream)
+{
+  rel_t *r;
+  uint32_t hash;
+
+  if(!relHashSize){
+    return NULL;
+  }
+
+  hash = peer_hash(ss, stream);
+  for(r = relHash[hash & (relHashSize - 1)]; r; r = r->hashNext){
+    if(r->peerHash == hash && conn_stream(r->c) == stream && addreq(conn_peer(r->c), ss)){
+      return r;
+    }
+  }
+  return NULL;
+}
+
+void insert_connection(rel_t *ReliableState)
+{
+  rel_t **bucket;
+
+  /*Keep the load factor at most 1 by doubling the table*/
+  if(relHashCount >= relHashSize){
+    uint32_t newSize = relHashSize ? 2 * relHashSize : 64;
+    rel_t **newHash = xmalloc(newSize * sizeof(*newHash));
+    uint32_t i;
+
+    memset(newHash, 0, newSize * sizeof(*newHash));
+    for(i = 0; i < relHashSize; i++){
+      rel_t *r, *next;
+      for(r = relHash[i]; r; r = next){
+        next = r->hashNext;
+        r->hashNext = newHash[r->peerHash & (newSize - 1)];
+        newHash[r->peerHash & (newSize - 1)] = r;
+      }
+    }
+    free(relHash);
+    relHash = newHash;
+    relHashSize = newSize;
+  }
+
+  bucket = &relHash[ReliableState->peerHash & (relHashSize - 1)];
+  ReliableState->hashNext = *bucket;
+  *bucket = ReliableState;
+  ReliableState->hashed = 1;
+  relHashCount++;
+}
+
+void remove_connection(rel_t *ReliableState)
+{
+  rel_t **rp;
+
+  for(rp = &relHash[ReliableState->peerHash & (relHashSize - 1)]; *rp; rp = &(*rp)->hashNext){
+    if(*rp == ReliableState){
+      *rp = ReliableState->hashNext;
+      ReliableState->hashed = 0;
+      if(--relHashCount == 0){
+        free(relHash);
+        relHash = NULL;
+        relHashSize = 0;
+      }
+      return;
+    }
+  }
 }
@@ -12,17 +12,45 @@
 #include <assert.h>
 #include <stddef.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "rlib.h"
+#include "librel.h"
+#include "trace.h"
 
 char *progname;
 int opt_debug;
-int log_in = -1;
-int log_out = -1;
+
+/* -l logs everything read by conn_input and written by conn_output.
+ * The event loop only copies the data into a ring; a writer thread
+ * empties the rings in large writes, so a slow disk never stalls the
+ * transport.  Each ring has a single producer (the event loop) and a
+ * single consumer (the writer thread), so head and tail only need
+ * ordering, not a lock.  When a ring is full the data is dropped and
+ * counted, or with --log-block the event loop waits for room. */
+#define LOG_RING_SIZE (1 << 20)	/* must be a power of 2 */
+#define LOG_IDLE_USEC 10000	/* writer sleep when the rings are empty */
+
+struct log_ring {
+  int fd;
+  char *buf;
+  atomic_size_t head;		/* advanced by the event loop */
+  atomic_size_t tail;		/* advanced by the writer thread */
+  uint64_t dropped;		/* bytes, only touched by the event loop */
+};
+
+static struct log_ring log_in = { -1 };
+static struct log_ring log_out = { -1 };
+static int log_block;
+static int log_started;
 
 struct config_client {
   struct config_common c;
@@ -38,17 +66,35 @@ struct config_server {
 				   address */
 };
 
-static struct config_server *serverconf;
+static volatile sig_atomic_t stats_requested;
+
+/* Binary packet trace, see trace.h.  The ring is shared by the loops
+ * of all threads. */
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static _Atomic uint64_t trace_next;	/* records ever added */
+static const char *trace_file;	/* --trace: dump here, and at exit */
+static volatile sig_atomic_t trace_requested;
+static atomic_uint conn_ids;
+
+#define CONN_BUFSIZE 8192
+
+/* Memory pool (-G).  The output queues of all connections and the
+ * buffers reliable takes with conn_bufalloc are charged to the
+ * connection holding them, and together stay within pool_budget.
+ * While less than half the budget is in use, any connection may grow
+ * up to its own buffer size; past that, the pool is tight and each
+ * connection only gets its fair share, pool_budget / nconns.  A
+ * connection with nothing queued can always write POOL_MIN, so that
+ * none is shut out for good.  Blocks of POOL_BLOCK bytes, which hold
+ * one packet, are recycled through a free list shared by all. */
+#define CONN_BUFMEM (64 << 20)
+#define POOL_MIN 1024
+#define POOL_BLOCK sizeof (packet_t)
+#define POOL_FREE_MAX 1024	/* blocks kept on the free list */
 
 static void conn_mkevents (void);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		       struct sockaddr_storage *from);
-
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+		       struct sockaddr_storage *from, uint32_t *stream);
 
 struct chunk {
   struct chunk *next;
@@ -58,24 +104,58 @@ struct chunk {
 };
 typedef struct chunk chunk_t;
 
+/* Chunks of the output queue conn_drain hands to one writev */
+#define DRAIN_IOV_MAX 64
+
+/* One of several UDP sockets a connection stripes its packets over
+ * (-m).  Path 0 is always nfd. */
+#define MAX_PATHS 8
+#define PATH_LOSS_ONE 65536
+
+struct path {
+  int fd;			/* connected UDP socket */
+  int poll;			/* offset into cevents array */
+  int dead;			/* got ICMP port unreachable */
+  long srtt;			/* smoothed RTT in usec, 0 until sampled */
+  uint32_t loss;		/* loss rate, PATH_LOSS_ONE = all lost */
+  int weight;			/* share of the packets */
+  int current;			/* smooth weighted round-robin credit */
+};
+
 struct conn {
   rel_t *rel;			/* Data from reliable */
+  uint32_t id;			/* Number in packet traces */
+  size_t bufsize;		/* Output buffering, see conn_setbufsize */
+  size_t charged;		/* bytes it holds of the pool (-G) */
 
   int rpoll;			/* offsets into cevents array */
   int wpoll;
   int npoll;
 
   int rfd;			/* input file descriptor */
+  const char *map;		/* input mapped in memory (-f), or NULL */
+  size_t maplen;
+  size_t mapoff;		/* how far conn_input got in it */
   int wfd;			/* output file descriptor */
   int nfd;			/* network file descriptor */
-  char server;			/* non-zero on server */
-  struct sockaddr_storage peer;	/* network peer */
-
-  char read_eof;	        /* zero if haven't received EOF */
-  char write_eof;		/* send EOF when output queue drained */
-  char write_err;	        /* zero if it's okay to write to wfd */
-  char xoff;			/* non-zero to pause reading */
-  char delete_me;		/* delete after draining */
+  struct sockaddr_storage *peer; /* network peer, only addrsize () bytes */
+  struct path *paths;		/* NULL unless multipath */
+  int npaths;
+  int lastpath;			/* path of the last packet sent */
+  uint32_t stream;		/* stream in a multiplexed session, or 0 */
+  struct conn *muxnext;		/* client: chain in mux_hash */
+  int weight;			/* -Q: packets per turn, in quanta */
+  int prio;
+  int deficit;			/* -Q: packets it may still send */
+  struct conn *schednext;	/* -Q: chain in sched_queue */
+
+  unsigned server : 1;		/* non-zero on server */
+  unsigned read_eof : 1;	/* zero if haven't received EOF */
+  unsigned write_eof : 1;	/* send EOF when output queue drained */
+  unsigned write_err : 2;	/* zero if it's okay to write to wfd */
+  unsigned xoff : 1;		/* non-zero to pause reading */
+  unsigned delete_me : 1;	/* delete after draining */
+  unsigned sched_wait : 1;	/* in sched_queue */
   chunk_t *outq;		/* chunks not yet written */
   chunk_t **outqtail;
 
@@ -83,8 +163,160 @@ struct conn {
   struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+
+/* Multiplexed sessions (-X).  All the TCP connections a client accepts
+ * share one UDP socket to the server, each as a stream of its own, and
+ * every datagram starts with its stream number in network byte order.
+ * A stream is still a connection of its own to reliable, so streams
+ * are ordered independently and a loss on one never holds up another. */
+#define MUX_HASH_SIZE 1024	/* must be a power of 2 */
+#define MUX_POLL 2		/* cevents slot of the session socket */
+
+/* Fair scheduling (-Q, see conn_maysend).  A connection that may not
+ * send waits in the queue of its priority; at the end of conn_poll,
+ * sched_run takes the queues in turn from the highest priority (0),
+ * adding weight * SCHED_QUANTUM to the deficit of each connection it
+ * comes to, until the round's budget is spent.  Deficit that a connection
+ * does not use because it has nothing more to send is dropped, as in
+ * DRR. */
+#define SCHED_QUANTUM 2
+#define MAX_SCHED_RULES 16
+struct sched_rule {		/* -W */
+  struct sockaddr_storage addr;	/* port 0 matches any port */
+  int weight;
+  int prio;
+};
+
+/* UDP segmentation offload (Linux, turned off by -O).  conn_sendpkt
+ * does not send right away: packets of the same size to the same
+ * place collect in gso_buf, and go to the kernel as one buffer with
+ * UDP_SEGMENT, which cuts it back into datagrams -- after everything
+ * else has been done on the way down, or in the NIC.  The batch goes
+ * out before conn_poll waits, when the next packet cannot join it,
+ * and before a socket is closed.  A short packet may end a batch.  If
+ * the kernel turns the option down, packets are sent one by one from
+ * then on.
+ *
+ * On receive, UDP_GRO lets the kernel hand up a train of datagrams as
+ * one buffer; debug_recv deals them out one at a time again. */
+#define GSO_MAX_SEGS 64		/* UDP_MAX_SEGMENTS in the kernel */
+#define GSO_SEG_MAX (sizeof (uint32_t) + sizeof (packet_t))
+#define GRO_BUF_SIZE 65536
+struct gso_batch {
+  int fd;
+  struct sockaddr_storage peer;	/* unused on connected sockets */
+  socklen_t peerlen;		/* 0 on connected sockets */
+  size_t size;			/* of each segment, the last may be less */
+  size_t len;
+  int nsegs;
+  char buf[GSO_MAX_SEGS * GSO_SEG_MAX];
+};
+struct gro_train {
+  int fd;			/* socket the segments left came from */
+  char *next;			/* next segment */
+  char *end;
+  size_t size;			/* of each segment, the last may be less */
+  struct sockaddr_storage from;
+  struct timespec time;
+  char buf[GRO_BUF_SIZE];
+};
+
+/* Backend pool (-C max, server).  Opening the TCP connection to the
+ * destination when a client's first packet comes in holds up conn_demux
+ * and everyone behind it.  Instead, up to max connections are opened
+ * ahead of time, without waiting for them; while connecting, each
+ * sits in a cevents slot of its own from BACKEND_POLL on, watched for
+ * POLLOUT.  conn_create takes one that is up, and the next conn_poll
+ * opens another.  The pool follows the arrival rate: once a tick it
+ * is sized to twice the connections created per tick, on average. */
+#define BACKEND_POLL (MUX_POLL + 1)
+struct backend {
+  int fd;			/* -1 if the slot is free */
+  int ready;			/* connected, else in progress */
+};
+
+/* addr_ratelimit: token buckets by host.  A host shares its bucket
+ * with those that hash to the same slot, which only makes it stricter
+ * for them. */
+#define RATELIMIT_SLOTS 4096
+struct ratelimit {
+  uint32_t msec;		/* last refilled */
+  uint32_t tokens;		/* in thousandths */
+};
+
+/* Everything an event loop owns.  A program may run one loop per
+ * thread (see librel.h); rlib works on the loop of the calling thread,
+ * which rel_loop_new binds to it.  What is left at file scope is
+ * shared by all loops: the options of main, the logs, which only main
+ * opens, and the packet trace. */
+struct rel_loop {
+  struct config_common cc;	/* of the connections it opens */
+  struct config_server *serverconf;
+  struct config_server server;	/* serverconf, once rel_listen is called */
+  rel_accept_fn *accept;	/* rel_listen: new connection to hand out */
+  void *accept_arg;
+  int nostderr;			/* do not watch stderr (a library loop) */
+
+  struct timespec rcvtime;	/* Arrival of packet being delivered */
+  int rcvpath;			/* Path it arrived on */
+  uint32_t rcvstream;		/* Stream it belongs to (-X) */
+  const struct sockaddr_storage *rcvfrom; /* Its source (rel_demux) */
+  const void *rcvsumbuf;	/* Packet summed as it was copied in, */
+  size_t rcvsumlen;		/* its length */
+  uint32_t rcvsum;		/* and partial checksum */
+
+  int nconns;
+  conn_t *conn_list;
+  struct timespec last_timeout;
+  int cevents_generation;
+  int last_cg;
+  struct pollfd *cevents;
+  int ncevents;
+  conn_t **evreaders;
+  conn_t **evwriters;
+
+  size_t pool_budget;		/* -G */
+  size_t pool_used;
+  size_t pool_peak;
+  void *pool_free;		/* free blocks, chained through their
+				   first word */
+  int pool_nfree;
+  unsigned long pool_refused;	/* conn_bufalloc calls turned down */
+  unsigned long pool_tight;	/* times it became tight */
+
+  int opt_mux;
+  int mux_fd;			/* client: the session socket */
+  uint32_t mux_streams;		/* client: streams ever opened */
+  conn_t *mux_hash[MUX_HASH_SIZE]; /* client: streams by number */
+
+  int sched_budget;		/* packets per conn_poll, 0 = no scheduling */
+  int sched_left;		/* of this round */
+  conn_t *sched_queue[SCHED_PRIOS];
+  conn_t **sched_tail[SCHED_PRIOS];
+  struct sched_rule sched_rules[MAX_SCHED_RULES];
+  int nsched_rules;
+
+  int opt_nooffload;
+  int gso_ok;			/* cleared when the kernel says no */
+  struct gso_batch gso;
+  struct gro_train *gro;	/* NULL unless some socket has UDP_GRO */
+  unsigned long gso_sends, gso_pkts, gro_reads, gro_pkts;
+
+  int backend_max;		/* -C, 0 = no pool */
+  struct backend *backends;	/* backend_max of them */
+  int backend_target;		/* how many to keep */
+  int backend_arrivals;		/* connections created this tick */
+  int backend_rate;		/* per tick on average, in 1/256ths */
+  int backend_down;		/* the last one failed: let conn_create
+				   try first */
+  unsigned long backend_hits, backend_misses;
+
+  uint64_t mac_key[2];		/* addrmac */
+  int mac_keyed;
+  struct ratelimit *ratelimit;	/* RATELIMIT_SLOTS of them, or NULL */
+};
+
+static __thread struct rel_loop *loop;
 
 #if !DMALLOC
 void *
@@ -100,6 +332,133 @@ xmalloc (size_t n)
 }
 #endif /* !DMALLOC */
 
+/* Copy one record into the ring.  Records are never split: one that
+ * does not fit is dropped whole. */
+static void
+log_append (struct log_ring *lr, const struct iovec *iov, int iovcnt)
+{
+  size_t head, n = 0, off, len;
+  int i;
+
+  if (lr->fd < 0)
+    return;
+  for (i = 0; i < iovcnt; i++)
+    n += iov[i].iov_len;
+
+  head = atomic_load_explicit (&lr->head, memory_order_relaxed);
+  while (LOG_RING_SIZE - (head - atomic_load_explicit (&lr->tail,
+						       memory_order_acquire))
+	 < n) {
+    if (!log_block || n > LOG_RING_SIZE || !log_started) {
+      lr->dropped += n;
+      return;
+    }
+    usleep (100);
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    const char *p = iov[i].iov_base;
+    for (len = iov[i].iov_len; len > 0; ) {
+      size_t chunk;
+      off = head & (LOG_RING_SIZE - 1);
+      chunk = LOG_RING_SIZE - off < len ? LOG_RING_SIZE - off : len;
+      memcpy (lr->buf + off, p, chunk);
+      p += chunk;
+      len -= chunk;
+      head += chunk;
+    }
+  }
+  atomic_store_explicit (&lr->head, head, memory_order_release);
+}
+
+/* The writer thread, which only the reliable program starts */
+#ifndef LIBREL
+static pthread_t log_thread;
+static atomic_int log_stop;
+
+static void
+log_open (struct log_ring *lr, const char *name)
+{
+  lr->fd = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if (lr->fd < 0) {
+    perror (name);
+    return;
+  }
+  lr->buf = xmalloc (LOG_RING_SIZE);
+}
+
+/* Write out whatever is in the ring, up to the end of the buffer.
+ * Returns 0 if there was nothing to write. */
+static int
+log_flush (struct log_ring *lr)
+{
+  size_t head, tail, off, len;
+  ssize_t n;
+
+  if (lr->fd < 0)
+    return 0;
+  tail = atomic_load_explicit (&lr->tail, memory_order_relaxed);
+  head = atomic_load_explicit (&lr->head, memory_order_acquire);
+  if (head == tail)
+    return 0;
+
+  off = tail & (LOG_RING_SIZE - 1);
+  len = head - tail;
+  if (len > LOG_RING_SIZE - off)
+    len = LOG_RING_SIZE - off;
+  n = write (lr->fd, lr->buf + off, len);
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n < 0) {
+    /* Give up on this log rather than stall the transport */
+    perror ("log write");
+    n = head - tail;
+  }
+  atomic_store_explicit (&lr->tail, tail + n, memory_order_release);
+  return 1;
+}
+
+static void *
+log_writer (void *arg)
+{
+  for (;;) {
+    int busy = log_flush (&log_in);
+    busy |= log_flush (&log_out);
+    if (!busy) {
+      if (atomic_load (&log_stop))
+	break;
+      usleep (LOG_IDLE_USEC);
+    }
+  }
+  return NULL;
+}
+
+/* Runs at exit: let the writer drain the rings, then report losses. */
+static void
+log_finish (void)
+{
+  atomic_store (&log_stop, 1);
+  pthread_join (log_thread, NULL);
+  if (log_in.dropped || log_out.dropped)
+    fprintf (stderr, "[log: dropped %llu input and %llu output bytes]\n",
+	     (unsigned long long) log_in.dropped,
+	     (unsigned long long) log_out.dropped);
+}
+
+static void
+log_start (void)
+{
+  if (log_in.fd < 0 && log_out.fd < 0)
+    return;
+  if (pthread_create (&log_thread, NULL, log_writer, NULL)) {
+    fprintf (stderr, "%s: cannot start log thread\n", progname);
+    exit (1);
+  }
+  log_started = 1;
+  atexit (log_finish);
+}
+#endif /* !LIBREL */
+
 #if NEED_CLOCK_GETTIME
 int
 clock_gettime (int id, struct timespec *tp)
@@ -145,39 +504,576 @@ print_pkt (const packet_t *buf, const char *op, int n)
   errno = saved_errno;
 }
 
-int
-conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+/* Share of the packets of each path: proportional to its delivery
+ * rate, i.e. to (1 - loss) / RTT.  Paths not timed yet are assumed as
+ * fast as the average of the others. */
+static void
+conn_pathweights (conn_t *c)
+{
+  struct path *p;
+  long sum = 0, rtt;
+  int known = 0;
+
+  for (p = c->paths; p < c->paths + c->npaths; p++)
+    if (p->srtt) {
+      sum += p->srtt;
+      known++;
+    }
+
+  for (p = c->paths; p < c->paths + c->npaths; p++) {
+    if (p->dead) {
+      p->weight = 0;
+      continue;
+    }
+    rtt = p->srtt ? p->srtt : known ? sum / known : 1000;
+    p->weight = (int) ((uint64_t) (PATH_LOSS_ONE - p->loss) * 100000
+		       / PATH_LOSS_ONE * 1000 / (rtt + 1));
+    if (p->weight < 1)
+      p->weight = 1;
+  }
+}
+
+/* Smooth weighted round-robin: spreads each path's share evenly
+ * instead of sending it in bursts. */
+static int
+conn_pickpath (conn_t *c)
+{
+  struct path *p, *best = NULL;
+  int total = 0;
+
+  for (p = c->paths; p < c->paths + c->npaths; p++) {
+    if (p->dead)
+      continue;
+    p->current += p->weight;
+    total += p->weight;
+    if (!best || p->current > best->current)
+      best = p;
+  }
+  if (!best)
+    return 0;
+  best->current -= total;
+  return best - c->paths;
+}
+
+#ifdef UDP_SEGMENT
+static int
+gso_send (int fd, void *buf, size_t len, size_t size)
+{
+  struct iovec iov = { buf, len };
+  struct msghdr msg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (uint16_t))];
+  } control;
+  struct gso_batch *g = &loop->gso;
+
+  memset (&msg, 0, sizeof (msg));
+  if (g->peerlen) {
+    msg.msg_name = &g->peer;
+    msg.msg_namelen = g->peerlen;
+  }
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (size < len) {
+    struct cmsghdr *cm;
+    uint16_t segsize = size;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof (control);
+    cm = CMSG_FIRSTHDR (&msg);
+    cm->cmsg_level = IPPROTO_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN (sizeof (segsize));
+    memcpy (CMSG_DATA (cm), &segsize, sizeof (segsize));
+  }
+  return sendmsg (fd, &msg, 0);
+}
+
+/* Send the batch.  Errors other than the kernel refusing segmentation
+ * are losses, as they are to a packet sent by itself. */
+static void
+gso_flush (void)
+{
+  struct gso_batch *g = &loop->gso;
+  char *p;
+
+  if (!g->nsegs)
+    return;
+  loop->gso_sends++;
+  loop->gso_pkts += g->nsegs;
+  if (gso_send (g->fd, g->buf, g->len, g->size) < 0 && g->nsegs > 1
+      && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP
+	  || errno == ENOPROTOOPT)) {
+    loop->gso_ok = 0;
+    loop->gso_sends += g->nsegs - 1;
+    for (p = g->buf; p < g->buf + g->len; p += g->size)
+      gso_send (g->fd, p, g->size < (size_t) (g->buf + g->len - p)
+		? g->size : (size_t) (g->buf + g->len - p), g->size);
+  }
+  g->nsegs = 0;
+  g->len = 0;
+}
+
+static void
+gso_add (int fd, const struct sockaddr_storage *peer, uint32_t stream,
+	 const packet_t *pkt, size_t len)
+{
+  size_t seglen = len + (stream ? sizeof (stream) : 0);
+  socklen_t peerlen = peer ? addrsize (peer) : 0;
+  struct gso_batch *g = &loop->gso;
+
+  if (g->nsegs
+      && (g->fd != fd || g->peerlen != peerlen
+	  || (peer && memcmp (&g->peer, peer, peerlen))
+	  || seglen > g->size || g->len % g->size
+	  || g->nsegs == GSO_MAX_SEGS))
+    gso_flush ();
+  if (!g->nsegs) {
+    g->fd = fd;
+    g->peerlen = peerlen;
+    if (peer)
+      memcpy (&g->peer, peer, peerlen);
+    g->size = seglen;
+  }
+  if (stream) {
+    uint32_t hdr = htonl (stream);
+    memcpy (g->buf + g->len, &hdr, sizeof (hdr));
+    g->len += sizeof (hdr);
+  }
+  memcpy (g->buf + g->len, pkt, len);
+  g->len += len;
+  g->nsegs++;
+}
+#else /* !UDP_SEGMENT */
+static void
+gso_flush (void)
+{
+}
+#endif /* !UDP_SEGMENT */
+
+/* Let the kernel coalesce datagrams arriving on s (UDP_GRO) */
+static void
+gro_enable (int s)
+{
+#ifdef UDP_GRO
+  int n = 1;
+  if (!loop || loop->opt_nooffload
+      || setsockopt (s, IPPROTO_UDP, UDP_GRO, (char *) &n, sizeof (n)) < 0)
+    return;
+  if (!loop->gro) {
+    loop->gro = xmalloc (sizeof (*loop->gro));
+    loop->gro->fd = -1;
+  }
+#endif /* UDP_GRO */
+}
+
+static void
+offload_print (void)
+{
+  fprintf (stderr, "[offload: %lu packets in %lu sends%s,"
+	   " %lu packets in %lu receives]\n", loop->gso_pkts, loop->gso_sends,
+	   loop->opt_nooffload || !loop->gso_ok ? " (segmentation off)" : "",
+	   loop->gro_pkts, loop->gro_reads);
+}
+
+/* One packet straight to the kernel: to peer unless the socket is
+ * connected (peer NULL), after its stream number if stream is not 0 */
+static int
+udp_send (int fd, const struct sockaddr_storage *peer, uint32_t stream,
+	  const packet_t *pkt, size_t len)
 {
   int n;
-  assert (!c->delete_me);
-  if (c->server)
-    n = sendto (c->nfd, pkt, len, 0,
-		(const struct sockaddr *) &c->peer, addrsize (&c->peer));
+
+  if (stream) {
+    uint32_t hdr = htonl (stream);
+    struct iovec iov[2] = { { &hdr, sizeof (hdr) }, { (void *) pkt, len } };
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    if (peer) {
+      msg.msg_name = (void *) peer;
+      msg.msg_namelen = addrsize (peer);
+    }
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    n = sendmsg (fd, &msg, 0);
+    if (n >= (int) sizeof (hdr))
+      n -= sizeof (hdr);
+  }
+  else if (peer)
+    n = sendto (fd, pkt, len, 0,
+		(const struct sockaddr *) peer, addrsize (peer));
   else
-    n = send (c->nfd, pkt, len, 0);
+    n = send (fd, pkt, len, 0);
   if (opt_debug)
     print_pkt (pkt, "send", n);
   return n;
 }
 
+int
+conn_sendpkt_on (conn_t *c, int path, const packet_t *pkt, size_t len)
+{
+  int fd = c->nfd;
+  assert (!c->delete_me);
+
+  if (c->npaths > 1) {
+    if (path < 0 || path >= c->npaths || c->paths[path].dead)
+      path = conn_pickpath (c);
+    fd = c->paths[path].fd;
+    /* Every packet sent is a chance for the loss rate to decay */
+    c->paths[path].loss -= c->paths[path].loss / 64;
+  }
+  else
+    path = 0;
+  c->lastpath = path;
+
+#ifdef UDP_SEGMENT
+  if (!loop->opt_nooffload && loop->gso_ok) {
+    gso_add (fd, c->server ? c->peer : NULL, c->stream, pkt, len);
+    if (opt_debug)
+      print_pkt (pkt, "send", len);
+    return len;
+  }
+#endif /* UDP_SEGMENT */
+
+  return udp_send (fd, c->server ? c->peer : NULL, c->stream, pkt, len);
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  return conn_sendpkt_on (c, -1, pkt, len);
+}
+
+int
+conn_npaths (conn_t *c)
+{
+  return c->npaths > 1 ? c->npaths : 1;
+}
+
+int
+conn_lastpath (conn_t *c)
+{
+  return c->lastpath;
+}
+
+int
+pkt_rcvpath (void)
+{
+  return loop->rcvpath;
+}
+
+uint32_t
+pkt_rcvstream (void)
+{
+  return loop->rcvstream;
+}
+
+int
+pkt_reply (const packet_t *pkt, size_t len)
+{
+  return udp_send (loop->serverconf->udp_socket, loop->rcvfrom,
+		   loop->rcvstream, pkt, len);
+}
+
+uint16_t
+pkt_rcvcksum (const packet_t *pkt, size_t len)
+{
+  uint32_t sum;
+
+  if (pkt == loop->rcvsumbuf && len == loop->rcvsumlen)
+    sum = loop->rcvsum;
+  else
+    sum = cksum_add (0, pkt, len);
+  /* Take the cksum field back out, as if it had been 0 */
+  return cksum_fold ((sum & 0xffff) + (sum >> 16) + (uint16_t) ~pkt->cksum);
+}
+
+uint32_t
+conn_stream (conn_t *c)
+{
+  return c->stream;
+}
+
+void
+conn_pathsample (conn_t *c, int path, long rtt)
+{
+  struct path *p;
+
+  if (c->npaths <= 1 || path < 0 || path >= c->npaths)
+    return;
+  p = &c->paths[path];
+  if (rtt < 0)
+    p->loss += (PATH_LOSS_ONE - p->loss) / 64;
+  else if (!p->srtt)
+    p->srtt = rtt ? rtt : 1;
+  else
+    p->srtt = (7 * p->srtt + rtt) / 8;
+  conn_pathweights (c);
+}
+
+void
+conn_trace (conn_t *c, int event, uint32_t seqno, uint32_t ackno, size_t len)
+{
+  struct trace_record *t
+    = &trace_ring[atomic_fetch_add_explicit (&trace_next, 1,
+					     memory_order_relaxed)
+		  & (TRACE_RING_SIZE - 1)];
+  struct timespec now;
+
+  if (event == TRACE_RECV || event == TRACE_DROP) {
+    now = loop->rcvtime;
+    t->path = loop->rcvpath;
+  }
+  else {
+    clock_gettime (CLOCK_REALTIME, &now);
+    t->path = c->lastpath;
+  }
+  t->usec = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  t->conn = c->id;
+  t->seqno = seqno;
+  t->ackno = ackno;
+  t->len = len;
+  t->event = event;
+}
+
+static int
+write_ring (int fd, uint64_t first, uint64_t next)
+{
+  size_t start = first & (TRACE_RING_SIZE - 1);
+  size_t n = next - first;
+  size_t tail = n < TRACE_RING_SIZE - start ? n : TRACE_RING_SIZE - start;
+  struct iovec iov[2];
+
+  iov[0].iov_base = &trace_ring[start];
+  iov[0].iov_len = tail * sizeof (trace_ring[0]);
+  iov[1].iov_base = trace_ring;
+  iov[1].iov_len = (n - tail) * sizeof (trace_ring[0]);
+  return writev (fd, iov, 2);
+}
+
+/* Write the trace ring, oldest record first.  Other threads may go on
+ * adding records meanwhile; the ones being overwritten come out
+ * garbled. */
+static void
+trace_dump (void)
+{
+  struct trace_header h;
+  char name[40];
+  const char *file = trace_file;
+  uint64_t first, next = trace_next;
+  int fd;
+
+  if (!file) {
+    snprintf (name, sizeof (name), "%d.trace", (int) getpid ());
+    file = name;
+  }
+  fd = open (file, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+  if (fd < 0) {
+    perror (file);
+    return;
+  }
+
+  first = next > TRACE_RING_SIZE ? next - TRACE_RING_SIZE : 0;
+  memset (&h, 0, sizeof (h));
+  h.magic = TRACE_MAGIC;
+  h.version = TRACE_VERSION;
+  h.record_size = sizeof (struct trace_record);
+  h.pid = getpid ();
+  h.count = next - first;
+  h.lost = first;
+
+  if (write (fd, &h, sizeof (h)) != sizeof (h)
+      || write_ring (fd, first, next) < 0)
+    perror (file);
+  close (fd);
+}
+
+#ifndef LIBREL
+/* Add a connected UDP socket as one more path of c. */
+static void
+conn_addpath (conn_t *c, int fd)
+{
+  struct path *p;
+
+  if (!c->paths) {
+    c->paths = xmalloc (MAX_PATHS * sizeof (*c->paths));
+    memset (c->paths, 0, MAX_PATHS * sizeof (*c->paths));
+    c->paths[0].fd = c->nfd;
+    c->npaths = 1;
+  }
+  assert (c->npaths < MAX_PATHS);
+  p = &c->paths[c->npaths++];
+  p->fd = fd;
+  conn_pathweights (c);
+  loop->cevents_generation++;
+}
+#endif /* !LIBREL */
+
+/* Path of c whose socket is fd, -1 if fd is not one of them. */
+static int
+conn_pathfd (conn_t *c, int fd)
+{
+  int i;
+
+  if (fd == c->nfd)
+    return 0;
+  for (i = 1; i < c->npaths; i++)
+    if (fd == c->paths[i].fd)
+      return i;
+  return -1;
+}
+
+/* ICMP error on one path of c.  Returns 1 if c can go on over the
+ * paths left, 0 if that was the last one. */
+static int
+conn_pathdown (conn_t *c, int path)
+{
+  int i, alive = 0;
+
+  if (c->npaths <= 1)
+    return 0;
+  for (i = 0; i < c->npaths; i++)
+    if (i != path && !c->paths[i].dead)
+      alive++;
+  if (!alive)
+    return 0;
+  fprintf (stderr, "[received ICMP port unreachable on path %d;"
+	   " using the %d left]\n", path, alive);
+  c->paths[path].dead = 1;
+  conn_pathweights (c);
+  loop->cevents_generation++;
+  return 1;
+}
+
+void
+pkt_rcvtime (struct timespec *ts)
+{
+  *ts = loop->rcvtime;
+}
+
+/* Fair share of the pool, once it is tight */
+static size_t
+pool_share (void)
+{
+  return loop->pool_budget / (loop->nconns > 0 ? loop->nconns : 1);
+}
+
+static void
+pool_charge (conn_t *c, size_t n)
+{
+  struct rel_loop *l = loop;
+
+  if (l->pool_used < l->pool_budget / 2
+      && l->pool_used + n >= l->pool_budget / 2)
+    l->pool_tight++;
+  c->charged += n;
+  l->pool_used += n;
+  if (l->pool_used > l->pool_peak)
+    l->pool_peak = l->pool_used;
+}
+
+static void
+pool_uncharge (conn_t *c, size_t n)
+{
+  c->charged -= n;
+  loop->pool_used -= n;
+}
+
+/* Bytes more c may take from the pool */
+static size_t
+pool_room (conn_t *c)
+{
+  struct rel_loop *l = loop;
+  size_t left = l->pool_used < l->pool_budget
+    ? l->pool_budget - l->pool_used : 0;
+  size_t share;
+
+  if (l->pool_used < l->pool_budget / 2)
+    return left;
+  share = pool_share ();
+  if (c->charged >= share)
+    return 0;
+  return share - c->charged < left ? share - c->charged : left;
+}
+
+void *
+conn_bufalloc (conn_t *c, size_t n, int force)
+{
+  void *p;
+
+  if (!force && pool_room (c) < n) {
+    loop->pool_refused++;
+    return NULL;
+  }
+  if (n <= POOL_BLOCK && loop->pool_free) {
+    p = loop->pool_free;
+    loop->pool_free = *(void **) p;
+    loop->pool_nfree--;
+  }
+  else
+    p = xmalloc (n <= POOL_BLOCK ? POOL_BLOCK : n);
+  pool_charge (c, n);
+  return p;
+}
+
+void
+conn_buffree (conn_t *c, void *p, size_t n)
+{
+  if (!p)
+    return;
+  pool_uncharge (c, n);
+  if (n <= POOL_BLOCK && loop->pool_nfree < POOL_FREE_MAX) {
+    *(void **) p = loop->pool_free;
+    loop->pool_free = p;
+    loop->pool_nfree++;
+  }
+  else
+    free (p);
+}
+
+static void
+pool_print (void)
+{
+  fprintf (stderr, "[pool: %lu of %lu bytes in use, peak %lu, share %lu,"
+	   " %d blocks free, tight %lu times, %lu buffers refused]\n",
+	   (unsigned long) loop->pool_used, (unsigned long) loop->pool_budget,
+	   (unsigned long) loop->pool_peak,
+	   (unsigned long) pool_share (),
+	   loop->pool_nfree, loop->pool_tight, loop->pool_refused);
+}
+
 size_t
 conn_bufspace (conn_t *c)
 {
   chunk_t *ch;
-  size_t used = 0;
-  const size_t bufsize = 8192;
-
+  size_t used = 0, room;
 
   for (ch = c->outq; ch; ch = ch->next)
     used += (ch->size - ch->used);
-  return used > bufsize ? 0 : bufsize - used;
+  if (used > c->bufsize)
+    return 0;
+  room = pool_room (c);
+  if (!c->outq && room < POOL_MIN)
+    room = POOL_MIN;
+  return c->bufsize - used < room ? c->bufsize - used : room;
+}
+
+size_t
+conn_setbufsize (conn_t *c, size_t size)
+{
+  size_t share = pool_share ();
+
+  if (size > share)
+    size = share;
+  if (size < CONN_BUFSIZE)
+    size = CONN_BUFSIZE;
+  c->bufsize = size;
+  return size;
 }
 
 int
-conn_output (conn_t *c, const void *_buf, size_t _n)
+conn_output (conn_t *c, const void *buf, size_t n)
 {
-  const char *buf = _buf;
-  int n = _n;
+  struct iovec iov;
 
   assert (!c->delete_me && !c->write_eof);
 
@@ -188,6 +1084,22 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     return 0;
   }
 
+  iov.iov_base = (void *) buf;
+  iov.iov_len = n;
+  return conn_outputv (c, &iov, 1);
+}
+
+int
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  size_t n = 0, r = 0;
+  int i;
+
+  assert (!c->delete_me && !c->write_eof && iovcnt > 0);
+
+  for (i = 0; i < iovcnt; i++)
+    n += iov[i].iov_len;
+
   if (c->write_err) {
     if (c->write_err == 2)
       fprintf (stderr, "conn_output: attempt to write after error\n");
@@ -198,81 +1110,438 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   if (!conn_bufspace (c))
     return 0;
 
-  if (log_out >= 0)
-    write (log_out, buf, n);
+  log_append (&log_out, iov, iovcnt);
 
   if (!c->outq) {
-    int r = write (c->wfd, buf, n);
-    if (r < 0) {
+    ssize_t w = writev (c->wfd, iov, iovcnt);
+    if (w < 0) {
       if (errno != EAGAIN) {
 	perror ("write");
 	c->write_err = 2;
 	return -1;
       }
     }
-    else {
-      buf += r;
-      n -= r;
-    }
+    else
+      r = w;
   }
 
-  if (n > 0) {
-    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
+  /* Only what the kernel did not take gets copied */
+  if (r < n) {
+    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n - r]));
+    size_t off = 0;
     ch->next = NULL;
-    ch->size = n;
+    ch->size = n - r;
     ch->used = 0;
-    memcpy (ch->buf, buf, n);
+    pool_charge (c, ch->size);
+    for (i = 0; i < iovcnt; i++) {
+      size_t len = iov[i].iov_len;
+      const char *base = iov[i].iov_base;
+      if (r >= len) {
+	r -= len;
+	continue;
+      }
+      memcpy (ch->buf + off, base + r, len - r);
+      off += len - r;
+      r = 0;
+    }
     *c->outqtail = ch;
     c->outqtail = &ch->next;
   }
 
-  if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
-  return _n;
+  if (c->wpoll && c->outq)
+    loop->cevents[c->wpoll].events |= POLLOUT;
+  return n;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t n)
+{
+  int r;
+  assert (!c->delete_me);
+
+  if (c->map) {
+    const void *data;
+    if ((r = conn_inputref (c, &data, n)) > 0)
+      memcpy (buf, data, r);
+    return r;
+  }
+  if (c->read_eof)
+    return -1;
+  r = read (c->rfd, buf, n);
+  if (r == 0 || (r < 0 && errno != EAGAIN)) {
+    if (r == 0)
+      errno = EIO;
+    r = -1;
+    c->read_eof = 1;
+    return r;
+  }
+  if (r < 0 && errno == EAGAIN)
+    r = 0;
+
+  if (r > 0) {
+    struct iovec iov = { buf, r };
+    log_append (&log_in, &iov, 1);
+  }
+
+  c->xoff = 0;
+  loop->cevents[c->rpoll].events |= POLLIN;
+  return r;
+}
+
+int
+conn_inputmapped (conn_t *c)
+{
+  return c->map != NULL;
+}
+
+int
+conn_inputref (conn_t *c, const void **data, size_t n)
+{
+  struct iovec iov;
+  assert (!c->delete_me && c->map);
+
+  if (c->read_eof)
+    return -1;
+  if (c->mapoff == c->maplen) {
+    errno = EIO;
+    c->read_eof = 1;
+    return -1;
+  }
+  if (n > c->maplen - c->mapoff)
+    n = c->maplen - c->mapoff;
+  *data = c->map + c->mapoff;
+  c->mapoff += n;
+
+  iov.iov_base = (void *) *data;
+  iov.iov_len = n;
+  log_append (&log_in, &iov, 1);
+
+  c->xoff = 0;
+  loop->cevents[c->rpoll].events |= POLLIN;
+  return n;
+}
+
+#ifndef LIBREL
+/* Map the regular file open on c->rfd (-f) */
+static void
+conn_mapinput (conn_t *c)
+{
+  struct stat st;
+  void *p;
+
+  /* Pipes, and empty files, which cannot be mapped, are read as usual */
+  if (fstat (c->rfd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_size == 0)
+    return;
+  p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, c->rfd, 0);
+  if (p == MAP_FAILED) {
+    perror ("mmap");
+    return;
+  }
+  madvise (p, st.st_size, MADV_SEQUENTIAL);
+  c->map = p;
+  c->maplen = st.st_size;
+}
+#endif /* !LIBREL */
+
+/* Keep only as much of the peer address as its family needs. */
+static void
+conn_setpeer (conn_t *c, const struct sockaddr_storage *ss)
+{
+  size_t n = addrsize (ss);
+  free (c->peer);
+  c->peer = xmalloc (n);
+  memcpy (c->peer, ss, n);
+}
+
+const struct sockaddr_storage *
+conn_peer (conn_t *c)
+{
+  return c->peer;
+}
+
+/* Whether peer matches the address of a -W rule; port 0 in the rule
+ * matches any port.  peer only has addrsize () bytes. */
+static int
+sched_addrmatch (const struct sockaddr_storage *rule,
+		 const struct sockaddr_storage *peer)
+{
+  if (rule->ss_family != peer->ss_family)
+    return 0;
+  switch (peer->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *r = (const struct sockaddr_in *) rule;
+      const struct sockaddr_in *p = (const struct sockaddr_in *) peer;
+      return (r->sin_addr.s_addr == p->sin_addr.s_addr
+	      && (!r->sin_port || r->sin_port == p->sin_port));
+    }
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *r = (const struct sockaddr_in6 *) rule;
+      const struct sockaddr_in6 *p = (const struct sockaddr_in6 *) peer;
+      return (!memcmp (&r->sin6_addr, &p->sin6_addr, sizeof (r->sin6_addr))
+	      && (!r->sin6_port || r->sin6_port == p->sin6_port));
+    }
+  }
+  return 0;
+}
+
+/* Weight and priority from the first -W rule matching the peer */
+static void
+sched_match (conn_t *c)
+{
+  struct sched_rule *sr;
+
+  for (sr = loop->sched_rules; sr < loop->sched_rules + loop->nsched_rules;
+       sr++)
+    if (sched_addrmatch (&sr->addr, c->peer)) {
+      conn_setsched (c, sr->weight, sr->prio);
+      return;
+    }
+}
+
+static void
+sched_unlink (conn_t *c)
+{
+  conn_t **cp = &loop->sched_queue[c->prio];
+
+  while (*cp != c)
+    cp = &(*cp)->schednext;
+  *cp = c->schednext;
+  if (loop->sched_tail[c->prio] == &c->schednext)
+    loop->sched_tail[c->prio] = cp;
+  c->sched_wait = 0;
+}
+
+static void
+sched_enqueue (conn_t *c)
+{
+  if (c->sched_wait)
+    return;
+  if (!loop->sched_queue[c->prio])
+    loop->sched_tail[c->prio] = &loop->sched_queue[c->prio];
+  c->schednext = NULL;
+  *loop->sched_tail[c->prio] = c;
+  loop->sched_tail[c->prio] = &c->schednext;
+  c->sched_wait = 1;
+}
+
+int
+conn_maysend (conn_t *c)
+{
+  if (!loop->sched_budget)
+    return 1;
+  if (c->deficit > 0 && loop->sched_left > 0) {
+    c->deficit--;
+    loop->sched_left--;
+    return 1;
+  }
+  sched_enqueue (c);
+  return 0;
+}
+
+void
+conn_setsched (conn_t *c, int weight, int prio)
+{
+  if (c->sched_wait)
+    sched_unlink (c);
+  c->weight = weight < 1 ? 1 : weight;
+  c->prio = prio < 0 ? 0 : prio >= SCHED_PRIOS ? SCHED_PRIOS - 1 : prio;
+}
+
+/* Give out the budget of a conn_poll to the waiting connections */
+static void
+sched_run (void)
+{
+  int prio;
+  conn_t *c;
+
+  loop->sched_left = loop->sched_budget;
+  for (prio = 0; prio < SCHED_PRIOS; prio++)
+    while (loop->sched_left > 0 && (c = loop->sched_queue[prio])) {
+      sched_unlink (c);
+      if (c->delete_me)
+	continue;
+      c->deficit += c->weight * SCHED_QUANTUM;
+      rel_read (c->rel);
+      /* Back in the queue if it used its turn up; otherwise it ran
+       * out of things to send */
+      if (!c->sched_wait)
+	c->deficit = 0;
+    }
+  /* Sends triggered by events until the next round use what is left */
+}
+
+static conn_t *
+conn_alloc (void)
+{
+  conn_t *c = xmalloc (sizeof (*c));
+  memset (c, 0, sizeof (*c));
+  c->id = atomic_fetch_add (&conn_ids, 1) + 1;
+  c->bufsize = CONN_BUFSIZE;
+  c->weight = 1;
+  loop->nconns++;
+  c->prev = &loop->conn_list;
+  c->next = loop->conn_list;
+  c->outqtail = &c->outq;
+  if (loop->conn_list)
+    loop->conn_list->prev = &c->next;
+  loop->conn_list = c;
+
+  loop->cevents_generation++;
+
+  return c;
+}
+
+#ifndef LIBREL
+/* Set up the backend pool (-C) */
+static void
+backend_init (int max)
+{
+  int i;
+
+  loop->backend_max = max;
+  loop->backends = xmalloc (max * sizeof (*loop->backends));
+  for (i = 0; i < max; i++)
+    loop->backends[i].fd = -1;
+  loop->backend_target = 1;
+  loop->cevents_generation++;
+}
+#endif /* !LIBREL */
+
+static void
+backend_close (int i)
+{
+  close (loop->backends[i].fd);
+  loop->backends[i].fd = -1;
+  if (loop->cevents)
+    loop->cevents[BACKEND_POLL + i].fd = -1;
+}
+
+/* Before conn_poll waits: top the pool up to its target */
+static void
+backend_fill (void)
+{
+  int i, n = 0;
+
+  for (i = 0; i < loop->backend_max; i++)
+    if (loop->backends[i].fd >= 0)
+      n++;
+  for (i = 0; i < loop->backend_max && n < loop->backend_target
+	 && !loop->backend_down; i++) {
+    int fd;
+    if (loop->backends[i].fd >= 0)
+      continue;
+    if ((fd = connect_to (0, &loop->serverconf->dest)) < 0) {
+      loop->backend_down = 1;
+      break;
+    }
+    loop->backends[i].fd = fd;
+    loop->backends[i].ready = 0;
+    loop->cevents[BACKEND_POLL + i].fd = fd;
+    loop->cevents[BACKEND_POLL + i].events = POLLOUT;
+    n++;
+  }
+}
+
+/* A connection of the pool is through, or not */
+static void
+backend_connected (int i)
+{
+  int err = 0;
+  socklen_t len = sizeof (err);
+
+  if (getsockopt (loop->backends[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+      || err) {
+    backend_close (i);
+    loop->backend_down = 1;
+    return;
+  }
+  loop->backends[i].ready = 1;
+  loop->cevents[BACKEND_POLL + i].fd = -1;
+}
+
+/* Once a tick: follow the arrival rate, and close what the pool no
+ * longer needs */
+static void
+backend_tick (void)
+{
+  int i, n = 0;
+
+  loop->backend_rate += loop->backend_arrivals * 32
+    - (loop->backend_rate + 7) / 8;
+  loop->backend_arrivals = 0;
+  loop->backend_target = 1 + 2 * ((loop->backend_rate + 255) >> 8);
+  if (loop->backend_target > loop->backend_max)
+    loop->backend_target = loop->backend_max;
+
+  for (i = 0; i < loop->backend_max; i++)
+    if (loop->backends[i].fd >= 0 && ++n > loop->backend_target)
+      backend_close (i);
 }
 
-int
-conn_input (conn_t *c, void *buf, size_t n)
+/* conn_create: a connection to the destination from the pool, or -1
+ * if none is up.  Those the destination closed while they waited are
+ * dropped on the way. */
+static int
+backend_take (void)
 {
-  int r;
-  assert (!c->delete_me);
+  int i, fd, n;
+  char b;
 
-  if (c->read_eof)
+  if (!loop->backend_max)
     return -1;
-  r = read (c->rfd, buf, n);
-  if (r == 0 || (r < 0 && errno != EAGAIN)) {
-    if (r == 0)
-      errno = EIO;
-    r = -1;
-    c->read_eof = 1;
-    return r;
+  loop->backend_arrivals++;
+  for (i = 0; i < loop->backend_max; i++) {
+    if (loop->backends[i].fd < 0 || !loop->backends[i].ready)
+      continue;
+    fd = loop->backends[i].fd;
+    n = recv (fd, &b, 1, MSG_PEEK);
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+      backend_close (i);
+      continue;
+    }
+    loop->backends[i].fd = -1;
+    loop->backend_hits++;
+    return fd;
   }
-  if (r < 0 && errno == EAGAIN)
-    r = 0;
+  loop->backend_misses++;
+  return -1;
+}
 
-  if (r > 0 && log_in >= 0)
-    write (log_in, buf, r);
+static void
+backend_print (void)
+{
+  int i, n = 0;
 
-  c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
-  return r;
+  if (!loop->backend_max)
+    return;
+  for (i = 0; i < loop->backend_max; i++)
+    if (loop->backends[i].ready && loop->backends[i].fd >= 0)
+      n++;
+  fprintf (stderr, "[backends: %d ready of %d, %lu taken,"
+	   " %lu connected on demand]\n", n, loop->backend_target,
+	   loop->backend_hits, loop->backend_misses);
 }
 
-static conn_t *
-conn_alloc (void)
+/* rel_listen: a socket pair for a new connection, one end for the
+ * application and the other for rlib.  Returns rlib's end. */
+static int
+accept_pair (const struct sockaddr_storage *ss)
 {
-  conn_t *c = xmalloc (sizeof (*c));
-  memset (c, 0, sizeof (*c));
-  c->prev = &conn_list;
-  c->next = conn_list;
-  c->outqtail = &c->outq;
-  if (conn_list)
-    conn_list->prev = &c->next;
-  conn_list = c;
-
-  cevents_generation++;
+  int sv[2];
 
-  return c;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror ("socketpair");
+    return -1;
+  }
+  if (loop->accept (sv[1], ss, loop->accept_arg) < 0) {
+    close (sv[0]);
+    close (sv[1]);
+    return -1;
+  }
+  make_async (sv[0]);
+  return sv[0];
 }
 
 conn_t *
@@ -284,27 +1553,35 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
   /* conn_create is only when the program is running as a server (and
    * rel_recvpkt is called with NULL packets.  If you call conn_create
    * in the client, you will see this assertion fail. */
-  assert (serverconf);
+  assert (loop->serverconf);
 
-  if ((n = connect_to (0, &serverconf->dest)) < 0) {
+  if (loop->accept) {
+    if ((n = accept_pair (ss)) < 0)
+      return NULL;
+  }
+  else if ((n = backend_take ()) < 0
+	   && (n = connect_to (0, &loop->serverconf->dest)) < 0) {
     char addr[NI_MAXHOST] = "unknown";
     char port[NI_MAXSERV] = "unknown";
     int saved_errno = errno;
-    getnameinfo ((const struct sockaddr *) &serverconf->dest,
-		 sizeof (serverconf->dest),
+    getnameinfo ((const struct sockaddr *) &loop->serverconf->dest,
+		 sizeof (loop->serverconf->dest),
 		 addr, sizeof (addr), port, sizeof (port),
 		 NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
     fprintf (stderr, "%s:%s: connect: %s\n",
 	     addr, port, strerror (saved_errno));
     return NULL;
   }
+  loop->backend_down = 0;	/* the destination is there */
 
   c = conn_alloc ();
-  c->peer = *ss;
+  conn_setpeer (c, ss);
   c->rel = rel;
-  c->nfd = serverconf->udp_socket;
+  c->nfd = loop->serverconf->udp_socket;
   c->rfd = c->wfd = n;
   c->server = 1;
+  c->stream = loop->rcvstream;
+  sched_match (c);
 
   return c;
 }
@@ -314,8 +1591,16 @@ conn_free (conn_t *c)
 {
   chunk_t *ch, *nch;
 
+  /* The batch may be for one of its sockets, and what is left of a
+   * train read from one is of no use */
+  gso_flush ();
+  if (loop->gro)
+    loop->gro->fd = -1;
+  loop->nconns--;
+
   for (ch = c->outq; ch; ch = nch) {
     nch = ch->next;
+    pool_uncharge (c, ch->size);
     free (ch);
   }
 
@@ -323,13 +1608,32 @@ conn_free (conn_t *c)
     c->next->prev = c->prev;
   *c->prev = c->next;
 
+  if (c->sched_wait)
+    sched_unlink (c);
+
+  if (c->stream && !c->server) {
+    conn_t **cp = &loop->mux_hash[c->stream & (MUX_HASH_SIZE - 1)];
+    while (*cp != c)
+      cp = &(*cp)->muxnext;
+    *cp = c->muxnext;
+  }
+
+  if (c->map)
+    munmap ((void *) c->map, c->maplen);
   close (c->rfd);
   if (c->wfd != c->rfd)
     close (c->wfd);
-  if (!c->server)
+  if (!c->server && !c->stream)
     close (c->nfd);
+  if (c->paths) {
+    int i;
+    for (i = 1; i < c->npaths; i++)
+      close (c->paths[i].fd);
+    free (c->paths);
+  }
+  free (c->peer);
 
-  cevents_generation++;
+  loop->cevents_generation++;
 
   /* to help catch errors */
   memset (c, 0xc5, sizeof (*c));
@@ -349,30 +1653,42 @@ conn_drain (conn_t *c)
   int didsome = 0;
 
   if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
+    loop->cevents[c->wpoll].events &= ~POLLOUT;
 
   if (c->write_err)
     return;
 
-  while ((ch = c->outq)) {
-    int n = write (c->wfd, ch->buf + ch->used,
-		   ch->size - ch->used);
+  while (c->outq) {
+    struct iovec iov[DRAIN_IOV_MAX];
+    int i = 0;
+    ssize_t n;
+
+    /* Write out as many chunks as possible in one go */
+    for (ch = c->outq; ch && i < DRAIN_IOV_MAX; ch = ch->next, i++) {
+      iov[i].iov_base = ch->buf + ch->used;
+      iov[i].iov_len = ch->size - ch->used;
+    }
+    n = writev (c->wfd, iov, i);
     if (n < 0) {
       if (errno != EAGAIN)
 	c->write_err = 1;
       break;
     }
     didsome = 1;
-    ch->used += n;
-    if (ch->used < ch->size) {
-      if (c->wpoll)
-	cevents[c->wpoll].events |= POLLOUT;
-      break;
+    while ((ch = c->outq) && (size_t) n >= ch->size - ch->used) {
+      n -= ch->size - ch->used;
+      c->outq = ch->next;
+      pool_uncharge (c, ch->size);
+      free (ch);
     }
-    c->outq = ch->next;
     if (!c->outq)
       c->outqtail = &c->outq;
-    free (ch);
+    else {
+      c->outq->used += n;
+      if (c->wpoll)
+	loop->cevents[c->wpoll].events |= POLLOUT;
+      break;
+    }
   }
   if (c->write_eof && !c->write_err && !c->outq) {
     c->write_err = 1;
@@ -387,10 +1703,11 @@ conn_mkevents (void)
 {
   struct pollfd *e;
   conn_t **r, **w;
-  size_t n = 2;
+  size_t n = BACKEND_POLL + loop->backend_max;
   conn_t *c;
+  int i;
 
-  for (c = conn_list; c; c = c->next) {
+  for (c = loop->conn_list; c; c = c->next) {
     if (c->read_eof) {
       c->rpoll = 0;
       if (c->write_err)
@@ -407,21 +1724,29 @@ conn_mkevents (void)
       else
 	c->wpoll = n++;
     }
-    if (c->server)
+    if (c->server || c->stream)
       c->npoll = 0;
     else
       c->npoll = n++;
+    for (i = 1; i < c->npaths; i++)
+      c->paths[i].poll = n++;
   }
 
   e = xmalloc (n * sizeof (*e));
   memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
+  if (loop->cevents)
+    e[0] = loop->cevents[0];
   else
     e[0].fd = -1;
-  e[1].fd = 2;			/* Do catch errors on stderr */
+  e[1].fd = loop->nostderr ? -1 : 2; /* Do catch errors on stderr */
+  e[MUX_POLL].fd = loop->mux_fd;
+  e[MUX_POLL].events = POLLIN;
+  for (i = 0; i < loop->backend_max; i++) {
+    e[BACKEND_POLL + i].fd = loop->backends[i].ready ? -1 : loop->backends[i].fd;
+    e[BACKEND_POLL + i].events = POLLOUT;
+  }
     
-  for (c = conn_list; c; c = c->next) {
+  for (c = loop->conn_list; c; c = c->next) {
     if (c->rpoll) {
       e[c->rpoll].fd = c->rfd;
       if (!c->xoff)
@@ -432,32 +1757,43 @@ conn_mkevents (void)
       if (c->outq)
 	e[c->wpoll].events |= POLLOUT;
     }
-    if (c->npoll) {
+    if (c->npoll && !(c->paths && c->paths[0].dead)) {
       e[c->npoll].fd = c->nfd;
       e[c->npoll].events |= POLLIN;
     }
+    else if (c->npoll)
+      e[c->npoll].fd = -1;
+    for (i = 1; i < c->npaths; i++)
+      if (!c->paths[i].dead) {
+	e[c->paths[i].poll].fd = c->paths[i].fd;
+	e[c->paths[i].poll].events |= POLLIN;
+      }
+      else
+	e[c->paths[i].poll].fd = -1;
   }
 
   r = xmalloc (n * sizeof (*r));
   memset (r, 0, n * sizeof (*r));
   w = xmalloc (n * sizeof (*w));
   memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
+  for (c = loop->conn_list; c; c = c->next) {
     if (c->rpoll > 0)
       r[c->rpoll] = c;
     if (c->npoll > 0)
       r[c->npoll] = c;
+    for (i = 1; i < c->npaths; i++)
+      r[c->paths[i].poll] = c;
     if (c->wpoll > 0)
       w[c->wpoll] = c;
   }
 
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
+  free (loop->cevents);
+  loop->cevents = e;
+  loop->ncevents = n;
+  free (loop->evreaders);
+  loop->evreaders = r;
+  free (loop->evwriters);
+  loop->evwriters = w;
 }
 
 static void
@@ -468,7 +1804,11 @@ conn_demux (const struct config_server *cs)
   int n;
 
   memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
+  loop->rcvpath = 0;
+  loop->rcvstream = 0;
+  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss,
+			  loop->opt_mux ? &loop->rcvstream : NULL)) >= 0) {
+    loop->rcvfrom = &ss;
     rel_demux (&cs->c, &ss, &pkt, n);
     memset (&pkt, 0xc7, n);	     /* to help debugging */
     memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
@@ -477,6 +1817,40 @@ conn_demux (const struct config_server *cs)
     perror ("UDP recv");
 }
 
+/* Hand the datagrams on the client's session socket to their streams */
+static void
+mux_input (void)
+{
+  packet_t pkt;
+  uint32_t stream;
+  conn_t *c;
+  int n;
+
+  loop->rcvpath = 0;
+  while ((n = debug_recv (loop->mux_fd, &pkt, sizeof (pkt), 0, NULL,
+			  &stream)) >= 0) {
+    for (c = loop->mux_hash[stream & (MUX_HASH_SIZE - 1)]; c; c = c->muxnext)
+      if (c->stream == stream)
+	break;
+    if (c && !c->delete_me) {
+      loop->rcvstream = stream;
+      rel_recvpkt (c->rel, &pkt, n);
+    }
+  }
+  if (errno == EAGAIN)
+    return;
+
+  /* Port unreachable: the server, and every stream with it, is gone.
+   * The next connection accepted opens a new session. */
+  perror ("session");
+  for (c = loop->conn_list; c; c = c->next)
+    if (c->stream && !c->delete_me)
+      rel_destroy (c->rel);
+  close (loop->mux_fd);
+  loop->mux_fd = -1;
+  loop->cevents_generation++;
+}
+
 long
 need_timer_in (const struct timespec *last, long timer)
 {
@@ -498,33 +1872,57 @@ void
 conn_poll (const struct config_common *cc)
 {
   //int n, i;
-  int  i;
+  int  i, path;
+  long timeout;
   conn_t *c, *nc;
-  static int last_cg;
 
-  if (last_cg != cevents_generation) {
+  if (loop->last_cg != loop->cevents_generation) {
     conn_mkevents ();
-    cevents_generation = last_cg;
+    loop->cevents_generation = loop->last_cg;
   }
-
-  if (cevents[0].fd >= 0)
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+  if (loop->backend_max && loop->serverconf)
+    backend_fill ();
+
+  timeout = need_timer_in (&loop->last_timeout, cc->timer);
+  for (i = 0; i < SCHED_PRIOS; i++)
+    if (loop->sched_queue[i])
+      timeout = 0;		/* connections are waiting for their turn */
+  gso_flush ();
+  if (loop->cevents[0].fd >= 0)
+    poll (loop->cevents, loop->ncevents, timeout);
   else
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-	if (cevents[i].fd == c->rfd) {
+    poll (loop->cevents+1, loop->ncevents-1, timeout);
+
+  for (i = 1; i < loop->ncevents; i++) {
+    if (i == MUX_POLL) {
+      if (loop->cevents[i].revents)
+	mux_input ();
+      loop->cevents[i].revents = 0;
+      continue;
+    }
+    if (i >= BACKEND_POLL && i < BACKEND_POLL + loop->backend_max) {
+      if (loop->cevents[i].revents)
+	backend_connected (i - BACKEND_POLL);
+      loop->cevents[i].revents = 0;
+      continue;
+    }
+    if (loop->cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+      if ((c = loop->evreaders[i]) && !c->delete_me) {
+	path = conn_pathfd (c, loop->cevents[i].fd);
+	if (loop->cevents[i].fd == c->rfd) {
 	  c->xoff = 1;
-	  cevents[i].events &= ~POLLIN;
+	  loop->cevents[i].events &= ~POLLIN;
 	  rel_read (c->rel);
 	}
-	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
+	else if (path >= 0 && (loop->cevents[i].revents & (POLLERR|POLLHUP))
+		 && conn_pathdown (c, path)) {
+	  /* Other paths are still alive, carry on with them */
+	}
+	else if (path >= 0
+		 && (loop->cevents[i].revents & (POLLERR|POLLHUP))) {
 	  char addr[NI_MAXHOST] = "unknown";
 	  char port[NI_MAXSERV] = "unknown";
-	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+	  getnameinfo ((const struct sockaddr *) c->peer, addrsize (c->peer),
 		       addr, sizeof (addr), port, sizeof (port),
 		       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
 	  fprintf (stderr, "[received ICMP port unreachable;"
@@ -533,65 +1931,70 @@ conn_poll (const struct config_common *cc)
 	    exit (1);
 	  rel_destroy (c->rel);
 	}
-	else if (cevents[i].fd == c->nfd && !c->server) {
+	else if (path >= 0 && !c->server) {
 	  packet_t pkt;
-	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-	  if (len < 0) {
-	    if (errno != EAGAIN)
-	      perror ("recv");
-	  }
-	  else {
+	  int len;
+	  /* Until the socket is empty: a read may bring several
+	   * datagrams (UDP_GRO) */
+	  while (!c->delete_me
+		 && (len = debug_recv (loop->cevents[i].fd, &pkt, sizeof (pkt), 0,
+				       NULL, NULL)) >= 0) {
+	    loop->rcvpath = path;
 	    rel_recvpkt (c->rel, &pkt, len);
 	    memset (&pkt, 0xc9, len); /* for debugging */
 	  }
+	  if (!c->delete_me && errno != EAGAIN)
+	    perror ("recv");
 	}
       }
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-	&& evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
+    if ((loop->cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
+	&& loop->evwriters[i])
+      conn_drain (loop->evwriters[i]);
+    if (loop->cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
       fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-	       getpid (), cevents[i].fd, cevents[i].revents);
+	       getpid (), loop->cevents[i].fd, loop->cevents[i].revents);
 #endif
       /* If stderr has an error, the tester has probably died, so exit
        * immediately. */
-      if (cevents[i].fd == 2)
+      if (loop->cevents[i].fd == 2)
 	exit (1);
-      cevents[i].fd = -1;
+      loop->cevents[i].fd = -1;
     }
-    cevents[i].revents = 0;
+    loop->cevents[i].revents = 0;
+  }
+
+  if (trace_requested) {
+    trace_requested = 0;
+    trace_dump ();
+  }
+
+  if (stats_requested) {
+    stats_requested = 0;
+    pool_print ();
+    offload_print ();
+    backend_print ();
+    rel_stats ();
   }
 
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
+  if (need_timer_in (&loop->last_timeout, cc->timer) == 0) {
     rel_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+    if (loop->backend_max)
+      backend_tick ();
+    clock_gettime (CLOCK_MONOTONIC, &loop->last_timeout);
   }
 
-  for (c = conn_list; c; c = nc) {
+  if (loop->sched_budget)
+    sched_run ();
+
+  for (c = loop->conn_list; c; c = nc) {
     nc = c->next;
     if (c->delete_me && (c->write_err || !c->outq))
       conn_free (c);
   }
 }
 
-uint16_t
-cksum (const void *_data, int len)
-{
-  const uint8_t *data = _data;
-  uint32_t sum;
-
-  for (sum = 0;len >= 2; data += 2, len -= 2)
-    sum += data[0] << 8 | data[1];
-  if (len > 0)
-    sum += data[0] << 8;
-  while (sum > 0xffff)
-    sum = (sum >> 16) + (sum & 0xffff);
-  sum = htons (~sum);
-  return sum ? sum : 0xffff;
-}
-
 int
 make_async (int s)
 {
@@ -688,6 +2091,133 @@ addrhash (const struct sockaddr_storage *ss)
   abort ();
 }
 
+/* SipHash-2-4 (Aumasson and Bernstein), for addrmac */
+static inline void
+sip_round (uint64_t v[4])
+{
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+  v[0] += v[1]; v[1] = ROTL (v[1], 13); v[1] ^= v[0]; v[0] = ROTL (v[0], 32);
+  v[2] += v[3]; v[3] = ROTL (v[3], 16); v[3] ^= v[2];
+  v[0] += v[3]; v[3] = ROTL (v[3], 21); v[3] ^= v[0];
+  v[2] += v[1]; v[1] = ROTL (v[1], 17); v[1] ^= v[2]; v[2] = ROTL (v[2], 32);
+#undef ROTL
+}
+
+static uint64_t
+siphash (const uint64_t key[2], const uint8_t *in, size_t len)
+{
+  uint64_t v[4] = {
+    key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+    key[0] ^ 0x6c7967656e657261ULL, key[1] ^ 0x7465646279746573ULL
+  };
+  uint64_t m;
+  size_t i, n = len;
+
+  for (; n >= 8; in += 8, n -= 8) {
+    for (m = 0, i = 0; i < 8; i++)
+      m |= (uint64_t) in[i] << (8 * i);
+    v[3] ^= m;
+    sip_round (v);
+    sip_round (v);
+    v[0] ^= m;
+  }
+  for (m = (uint64_t) len << 56, i = 0; i < n; i++)
+    m |= (uint64_t) in[i] << (8 * i);
+  v[3] ^= m;
+  sip_round (v);
+  sip_round (v);
+  v[0] ^= m;
+  v[2] ^= 0xff;
+  for (i = 0; i < 4; i++)
+    sip_round (v);
+  return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/* The secret of addrmac, drawn when it is first needed */
+static void
+mac_keygen (void)
+{
+  int fd = open ("/dev/urandom", O_RDONLY);
+
+  if (fd < 0 || read (fd, loop->mac_key, sizeof (loop->mac_key))
+      != sizeof (loop->mac_key)) {
+    /* Not much of a secret, but not the same twice */
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    loop->mac_key[0] = (uint64_t) ts.tv_sec << 32 ^ ts.tv_nsec;
+    loop->mac_key[1] = (uint64_t) getpid () << 32 ^ (uintptr_t) loop;
+  }
+  if (fd >= 0)
+    close (fd);
+  loop->mac_keyed = 1;
+}
+
+uint64_t
+addrmac (const struct sockaddr_storage *ss, int port, uint64_t n)
+{
+  uint8_t buf[sizeof (struct sockaddr_un) + sizeof (n)];
+  size_t len;
+
+  switch (ss->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *s = (const struct sockaddr_in *) ss;
+      memcpy (buf, &s->sin_addr, 4);
+      memcpy (buf + 4, &s->sin_port, 2);
+      len = port ? 6 : 4;
+    }
+    break;
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *s = (const struct sockaddr_in6 *) ss;
+      memcpy (buf, &s->sin6_addr, 16);
+      memcpy (buf + 16, &s->sin6_port, 2);
+      len = port ? 18 : 16;
+    }
+    break;
+  case AF_UNIX:
+    {
+      const struct sockaddr_un *s = (const struct sockaddr_un *) ss;
+      len = strnlen (s->sun_path, sizeof (s->sun_path));
+      memcpy (buf, s->sun_path, len);
+    }
+    break;
+  default:
+    fprintf (stderr, "addrmac: unknown address family %d\n",
+	     ss->ss_family);
+    abort ();
+  }
+  memcpy (buf + len, &n, sizeof (n));
+  if (!loop->mac_keyed)
+    mac_keygen ();
+  return siphash (loop->mac_key, buf, len + sizeof (n));
+}
+
+int
+addr_ratelimit (const struct sockaddr_storage *ss, int rate)
+{
+  struct ratelimit *rl;
+  struct timespec ts;
+  uint32_t now, full = rate * 1000;
+  uint64_t t;
+
+  if (!loop->ratelimit) {
+    loop->ratelimit = xmalloc (RATELIMIT_SLOTS * sizeof (*loop->ratelimit));
+    memset (loop->ratelimit, 0, RATELIMIT_SLOTS * sizeof (*loop->ratelimit));
+  }
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  rl = &loop->ratelimit[addrmac (ss, 0, 0) % RATELIMIT_SLOTS];
+  /* A slot never used is full: it was refilled at time 0 */
+  t = rl->tokens + (uint64_t) (uint32_t) (now - rl->msec) * rate;
+  rl->tokens = t < full ? t : full;
+  rl->msec = now;
+  if (rl->tokens < 1000)
+    return 0;
+  rl->tokens -= 1000;
+  return 1;
+}
+
 int
 get_address (struct sockaddr_storage *ss, int local,
 	     int dgram, int family, char *name)
@@ -765,6 +2295,12 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   }
   if (!dgram)
     setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+#ifdef SO_TIMESTAMPNS
+  else
+    setsockopt (s, SOL_SOCKET, SO_TIMESTAMPNS, (char *) &n, sizeof (n));
+#endif /* SO_TIMESTAMPNS */
+  if (dgram)
+    gro_enable (s);
   if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
     perror ("bind");
     close (s);
@@ -813,6 +2349,14 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     return -1;
   }
   make_async (s);
+#ifdef SO_TIMESTAMPNS
+  if (dgram) {
+    int n = 1;
+    setsockopt (s, SOL_SOCKET, SO_TIMESTAMPNS, (char *) &n, sizeof (n));
+  }
+#endif /* SO_TIMESTAMPNS */
+  if (dgram)
+    gro_enable (s);
   if (connect (s, (struct sockaddr *) ss, addrsize (ss)) < 0
       && errno != EINPROGRESS) {
     perror ("connect");
@@ -823,32 +2367,341 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
   return s;
 }
 
+#ifdef UDP_GRO
+/* Read a train of datagrams from s into gro */
 static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-	    struct sockaddr_storage *from)
+gro_fill (int s, int flags, int named)
+{
+  struct gro_train *gro = loop->gro;
+  struct iovec iov = { gro->buf, sizeof (gro->buf) };
+  struct msghdr msg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (struct timespec)) + CMSG_SPACE (sizeof (int))];
+  } control;
+  struct cmsghdr *cm;
+  int n, timed = 0;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_name = &gro->from;
+  msg.msg_namelen = named ? sizeof (gro->from) : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof (control);
+
+  gro->fd = -1;
+  n = recvmsg (s, &msg, flags);
+  if (n < 0)
+    return n;
+  gro->fd = s;
+  gro->next = gro->buf;
+  gro->end = gro->buf + n;
+  gro->size = n;
+  for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm)) {
+    if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+      int size;
+      memcpy (&size, CMSG_DATA (cm), sizeof (size));
+      if (size > 0)
+	gro->size = size;
+    }
+#ifdef SO_TIMESTAMPNS
+    else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+      memcpy (&gro->time, CMSG_DATA (cm), sizeof (gro->time));
+      timed = 1;
+    }
+#endif /* SO_TIMESTAMPNS */
+  }
+  if (!timed)
+    clock_gettime (CLOCK_REALTIME, &gro->time);
+  loop->gro_reads++;
+  loop->gro_pkts += gro->size ? (n + gro->size - 1) / gro->size : 1;
+  return n;
+}
+
+/* The next datagram of the train read from s, reading another if
+ * there is none left */
+static int
+gro_recv (int s, packet_t *buf, size_t len, int flags,
+	  struct sockaddr_storage *from, uint32_t *stream)
 {
-  socklen_t socklen = sizeof (*from);
+  struct gro_train *gro = loop->gro;
+  size_t seg, hlen = stream ? sizeof (uint32_t) : 0;
   int n;
+
+  if (gro->fd != s || gro->next >= gro->end) {
+    n = gro_fill (s, flags, from != NULL);
+    if (n <= 0) {
+      if (n == 0 && stream)
+	*stream = 0;
+      if (n == 0)
+	loop->rcvtime = gro->time;
+      return n;
+    }
+  }
+  seg = gro->end - gro->next < (ptrdiff_t) gro->size
+    ? (size_t) (gro->end - gro->next) : gro->size;
   if (from)
-    n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-  else
-    n = recv (s, buf, len, flags);
+    memcpy (from, &gro->from, sizeof (*from));
+  loop->rcvtime = gro->time;
+  if (stream) {
+    uint32_t hdr;
+    if (seg < hlen) {
+      gro->next += seg;
+      *stream = 0;
+      return 0;
+    }
+    memcpy (&hdr, gro->next, hlen);
+    *stream = ntohl (hdr);
+  }
+  n = seg - hlen < len ? seg - hlen : len;
+  /* The one copy of the packet in user space: checksum it meanwhile */
+  loop->rcvsum = cksum_copy (0, buf, gro->next + hlen, n);
+  loop->rcvsumbuf = buf;
+  loop->rcvsumlen = n;
+  gro->next += seg;
+  return n;
+}
+#endif /* UDP_GRO */
+
+/* With stream non-NULL the datagram starts with a stream number (-X),
+ * which goes to *stream.  Datagrams too short to have one are returned
+ * as empty packets of stream 0. */
+static int
+debug_recv (int s, packet_t *buf, size_t len, int flags,
+	    struct sockaddr_storage *from, uint32_t *stream)
+{
+  struct iovec iov[2];
+  struct msghdr msg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (struct timespec))];
+  } control;
+  uint32_t hdr = 0;
+  int n;
+
+#ifdef UDP_GRO
+  if (loop->gro) {
+    n = gro_recv (s, buf, len, flags, from, stream);
+    if (opt_debug)
+      print_pkt (buf, "recv", n);
+    return n;
+  }
+#endif /* UDP_GRO */
+
+  loop->rcvsumbuf = NULL;
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof (hdr);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = len;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_name = from;
+  msg.msg_namelen = from ? sizeof (*from) : 0;
+  msg.msg_iov = stream ? iov : iov + 1;
+  msg.msg_iovlen = stream ? 2 : 1;
+  msg.msg_control = &control;
+  msg.msg_controllen = sizeof (control);
+
+  n = recvmsg (s, &msg, flags);
+  if (n >= 0) {
+    struct cmsghdr *cm = NULL;
+#ifdef SO_TIMESTAMPNS
+    for (cm = CMSG_FIRSTHDR (&msg); cm; cm = CMSG_NXTHDR (&msg, cm))
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+	break;
+#endif /* SO_TIMESTAMPNS */
+    if (cm)
+      memcpy (&loop->rcvtime, CMSG_DATA (cm), sizeof (loop->rcvtime));
+    else
+      clock_gettime (CLOCK_REALTIME, &loop->rcvtime);
+    if (stream) {
+      *stream = n >= (int) sizeof (hdr) ? ntohl (hdr) : 0;
+      n = n >= (int) sizeof (hdr) ? n - (int) sizeof (hdr) : 0;
+    }
+  }
   if (opt_debug)
     print_pkt (buf, "recv", n);
   return n;
 }
 
 
+rel_loop_t *
+rel_loop_new (const struct config_common *cc,
+	      const struct rel_loop_options *opts)
+{
+  static const struct rel_loop_options defaults;
+  struct rel_loop *l;
+
+  if (loop) {
+    errno = EBUSY;
+    return NULL;
+  }
+  if (!opts)
+    opts = &defaults;
+  if (cc->window < 1 || cc->timeout < 10 || cc->deadline < 0
+      || opts->sched_budget < 0
+      || (opts->membudget && opts->membudget < CONN_BUFSIZE)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  l = xmalloc (sizeof (*l));
+  memset (l, 0, sizeof (*l));
+  l->cc = *cc;
+  if (l->cc.timer <= 0)
+    l->cc.timer = l->cc.timeout / 5;
+  l->cc.single_connection = 0;	/* a library does not exit */
+  l->nostderr = 1;
+  l->pool_budget = opts->membudget ? opts->membudget : CONN_BUFMEM;
+  l->opt_mux = opts->mux;
+  l->mux_fd = -1;
+  l->sched_budget = opts->sched_budget;
+  l->opt_nooffload = opts->nooffload;
+  l->gso_ok = 1;
+
+  loop = l;
+  conn_mkevents ();
+  return l;
+}
+
+void
+rel_loop_free (rel_loop_t *l)
+{
+  conn_t *c;
+  int i;
+
+  assert (l == loop);
+  for (c = l->conn_list; c; c = c->next)
+    if (!c->delete_me)
+      rel_destroy (c->rel);
+  while (l->conn_list)
+    conn_free (l->conn_list);
+
+  if (l->serverconf == &l->server)
+    close (l->server.udp_socket);
+  if (l->mux_fd >= 0)
+    close (l->mux_fd);
+  for (i = 0; i < l->backend_max; i++)
+    if (l->backends[i].fd >= 0)
+      close (l->backends[i].fd);
+  free (l->backends);
+  while (l->pool_free) {
+    void *p = l->pool_free;
+    l->pool_free = *(void **) p;
+    free (p);
+  }
+  free (l->gro);
+  free (l->ratelimit);
+  free (l->cevents);
+  free (l->evreaders);
+  free (l->evwriters);
+  free (l);
+  loop = NULL;
+}
+
+int
+rel_loop_poll (rel_loop_t *l)
+{
+  assert (l == loop);
+  conn_poll (&l->cc);
+  if (l->serverconf && l->cevents[0].revents)
+    conn_demux (l->serverconf);
+  return l->nconns;
+}
+
+int
+rel_loop_weight (rel_loop_t *l, const struct sockaddr_storage *addr,
+		 int weight, int prio)
+{
+  struct sched_rule *sr;
+
+  if (l->nsched_rules >= MAX_SCHED_RULES) {
+    errno = ENOSPC;
+    return -1;
+  }
+  sr = &l->sched_rules[l->nsched_rules++];
+  sr->addr = *addr;
+  sr->weight = weight;
+  sr->prio = prio;
+  return 0;
+}
+
+/* get_address on a copy of name, which it takes apart */
+static int
+lookup_address (struct sockaddr_storage *ss, int local, int family,
+		const char *name)
+{
+  char *copy = strdup (name);
+  int r;
+
+  if (!copy)
+    return -1;
+  r = get_address (ss, local, 1, family, copy);
+  free (copy);
+  return r;
+}
+
+int
+rel_connect (rel_loop_t *l, const char *local, const char *remote)
+{
+  struct sockaddr_storage sl, sr;
+  int s, sv[2];
+  conn_t *c;
+
+  assert (l == loop);
+  if (lookup_address (&sr, 0, AF_INET, remote) < 0
+      || lookup_address (&sl, 1, sr.ss_family, local) < 0
+      || (s = listen_on (1, &sl)) < 0)
+    return -1;
+  if (connect (s, (struct sockaddr *) &sr, addrsize (&sr)) < 0
+      || socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror ("rel_connect");
+    close (s);
+    return -1;
+  }
+  make_async (s);
+  make_async (sv[0]);
+
+  c = conn_alloc ();
+  c->rfd = c->wfd = sv[0];
+  c->nfd = s;
+  conn_setpeer (c, &sr);
+  c->rel = rel_create (c, NULL, &l->cc);
+  return sv[1];
+}
+
+int
+rel_listen (rel_loop_t *l, const char *local, rel_accept_fn *fn, void *arg)
+{
+  struct sockaddr_storage ss;
+
+  assert (l == loop && !l->serverconf);
+  if (lookup_address (&ss, 1, AF_INET, local) < 0
+      || (l->server.udp_socket = listen_on (1, &ss)) < 0)
+    return -1;
+  make_async (l->server.udp_socket);
+  l->server.c = l->cc;
+  l->serverconf = &l->server;
+  l->accept = fn;
+  l->accept_arg = arg;
+  l->cevents[0].fd = l->server.udp_socket;
+  l->cevents[0].events = POLLIN;
+  return 0;
+}
+
+/* The rest is the reliable program, left out of librel */
+#ifndef LIBREL
+
 void
 do_client (struct config_client *cc)
 {
   conn_mkevents ();
   make_async (cc->listen_socket);
-  cevents[0].fd = cc->listen_socket;
-  cevents[0].events = POLLIN;
+  loop->cevents[0].fd = cc->listen_socket;
+  loop->cevents[0].events = POLLIN;
   for (;;) {
     conn_poll (&cc->c);
-    if (cevents[0].revents) {
+    if (loop->cevents[0].revents) {
       struct sockaddr_storage ss;
       socklen_t len = sizeof (ss);
       int s, u;
@@ -860,12 +2713,21 @@ do_client (struct config_client *cc)
       if (s < 0)
 	continue;
       make_async (s);
-      if ((u = connect_to (1, &cc->server)) >= 0) {
+      if (loop->opt_mux && loop->mux_fd < 0)
+	loop->mux_fd = connect_to (1, &cc->server);
+      if ((u = loop->opt_mux ? loop->mux_fd : connect_to (1, &cc->server)) >= 0) {
 	c = conn_alloc ();
 	c->rfd = s;
 	c->wfd = s;
 	c->nfd = u;
-	c->peer = cc->server;
+	if (loop->opt_mux) {
+	  conn_t **bucket;
+	  c->stream = ++loop->mux_streams;
+	  bucket = &loop->mux_hash[c->stream & (MUX_HASH_SIZE - 1)];
+	  c->muxnext = *bucket;
+	  *bucket = c;
+	}
+	conn_setpeer (c, &cc->server);
 	c->rel = rel_create (c, NULL, &cc->c);
 	conn_mkevents ();
       }
@@ -878,26 +2740,39 @@ do_client (struct config_client *cc)
 void
 do_server (struct config_server *cs)
 {
-  serverconf = cs;
+  loop->serverconf = cs;
   conn_mkevents ();
   make_async (cs->udp_socket);
-  cevents[0].fd = cs->udp_socket;
-  cevents[0].events = POLLIN;
-  for (;;) {
-    conn_poll (&cs->c);
-    if (cevents[0].revents)
-      conn_demux (cs);
-  }
+  loop->cevents[0].fd = cs->udp_socket;
+  loop->cevents[0].events = POLLIN;
+  for (;;)
+    rel_loop_poll (loop);
+}
+
+static void
+request_stats (int sig)
+{
+  stats_requested = 1;
+}
+
+static void
+request_trace (int sig)
+{
+  trace_requested = 1;
 }
 
 static void
 usage (void)
 {
   fprintf (stderr,
-	   "usage: %s udp-port [host:]udp-port\n"
-	   "       %s -c {-u unix-socket | tcp-port} [host:]udp-port\n"
-	   "       %s -s [-u] udp-port {unix-socket | [host:]tcp-port}\n"
-	   , progname, progname, progname);
+	   "usage: %s [-f file] [-m udp-port,[host:]udp-port ...]"
+	   " udp-port [host:]udp-port\n"
+	   "       %s -c [-X] [-K] {-u unix-socket | tcp-port} [host:]udp-port\n"
+	   "       %s -s [-X] [-K] [-u] [-C max] [-G bytes] [-Q budget"
+	   " [-W host:port=weight[,prio] ...]]\n"
+	   "            udp-port {unix-socket | [host:]tcp-port}\n"
+	   "       (-W prio 0, the default, is served first, %d last)\n"
+	   , progname, progname, progname, SCHED_PRIOS - 1);
   exit (1);
 }
 
@@ -910,15 +2785,40 @@ main (int argc, char **argv)
     { "server", no_argument, NULL, 's' },
     { "window", required_argument, NULL, 'w' },
     { "client", no_argument, NULL, 'c' },
+    { "timestamps", no_argument, NULL, 'T' },
+    { "fec", no_argument, NULL, 'F' },
+    { "compress", no_argument, NULL, 'Z' },
+    { "deadline", required_argument, NULL, 'P' },
+    { "stats", no_argument, NULL, 'S' },
+    { "multipath", required_argument, NULL, 'm' },
+    { "log-block", no_argument, NULL, 'B' },
+    { "trace", required_argument, NULL, 'R' },
+    { "autotune", no_argument, NULL, 'A' },
+    { "bufmax", required_argument, NULL, 'M' },
+    { "mux", no_argument, NULL, 'X' },
+    { "sched", required_argument, NULL, 'Q' },
+    { "weight", required_argument, NULL, 'W' },
+    { "membudget", required_argument, NULL, 'G' },
+    { "no-offload", no_argument, NULL, 'O' },
+    { "backends", required_argument, NULL, 'C' },
+    { "cookies", no_argument, NULL, 'K' },
+    { "file", required_argument, NULL, 'f' },
     { NULL, 0, NULL, 0 }
   };
   int opt;
   int opt_unix = 0;
   int opt_client = 0;
   int opt_server = 0;
+  int opt_backends = 0;
+  char *opt_file = NULL;
   char *local = NULL;
   char *remote = NULL;
+  char *paths[MAX_PATHS];
+  int npaths = 0;
   struct config_common c;
+  struct rel_loop_options lo;
+  struct sched_rule rules[MAX_SCHED_RULES];
+  int nrules = 0;
   struct sockaddr_storage ss;
   struct sigaction sa;
 
@@ -927,9 +2827,19 @@ main (int argc, char **argv)
   sa.sa_handler = SIG_IGN;
   sigaction (SIGPIPE, &sa, NULL);
 
+  /* SIGUSR1 dumps connection statistics */
+  sa.sa_handler = request_stats;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  /* SIGUSR2 dumps the packet trace */
+  sa.sa_handler = request_trace;
+  sigaction (SIGUSR2, &sa, NULL);
+
   memset (&c, 0, sizeof (c));
+  memset (&lo, 0, sizeof (lo));
   c.window = 1;
   c.timeout = 2000;
+  c.bufmax = 4 << 20;
 
   progname = strrchr (argv[0], '/');
   if (progname)
@@ -937,7 +2847,7 @@ main (int argc, char **argv)
   else
     progname = argv[0];
 
-  while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "cdust:w:lTFZP:Sm:BR:AM:XQ:W:G:OC:Kf:", o, NULL)) != -1)
     switch (opt) {
     case 'c':
       opt_client = 1;
@@ -949,13 +2859,9 @@ main (int argc, char **argv)
       {
 	char name[40];
 	snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
-	log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_in < 0)
-	  perror (name);
+	log_open (&log_in, name);
 	snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
-	log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_out < 0)
-	  perror (name);
+	log_open (&log_out, name);
       }
       break;
     case 'u':
@@ -970,16 +2876,99 @@ main (int argc, char **argv)
     case 't':
       c.timeout = atoi (optarg);
       break;
+    case 'T':
+      c.timestamps = 1;
+      break;
+    case 'F':
+      c.fec = 1;
+      break;
+    case 'Z':
+      c.compress = 1;
+      break;
+    case 'P':
+      c.deadline = atoi (optarg);
+      break;
+    case 'S':
+      c.stats = 1;
+      break;
+    case 'B':
+      log_block = 1;
+      break;
+    case 'A':
+      c.autotune = 1;
+      break;
+    case 'M':
+      c.bufmax = atol (optarg);
+      break;
+    case 'X':
+      lo.mux = 1;
+      break;
+    case 'Q':
+      lo.sched_budget = atoi (optarg);
+      break;
+    case 'G':
+      lo.membudget = strtoul (optarg, NULL, 0);
+      if (lo.membudget < CONN_BUFSIZE)
+	usage ();
+      break;
+    case 'O':
+      lo.nooffload = 1;
+      break;
+    case 'C':
+      opt_backends = atoi (optarg);
+      break;
+    case 'K':
+      c.cookies = 1;
+      break;
+    case 'f':
+      opt_file = optarg;
+      break;
+    case 'W':
+      {
+	/* host:port=weight[,prio] */
+	char *addr = strsep (&optarg, "=");
+	struct sched_rule *sr = &rules[nrules];
+	if (nrules >= MAX_SCHED_RULES || !optarg
+	    || get_address (&sr->addr, 0, 1, AF_INET, addr) < 0)
+	  usage ();
+	sr->weight = atoi (strsep (&optarg, ","));
+	sr->prio = optarg ? atoi (optarg) : 0;
+	nrules++;
+      }
+      break;
+    case 'R':
+      trace_file = optarg;
+      atexit (trace_dump);
+      break;
+    case 'm':
+      if (npaths + 1 >= MAX_PATHS || !strchr (optarg, ','))
+	usage ();
+      paths[npaths++] = optarg;
+      break;
     default:
       usage ();
       break;
     }
 
-  if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+  if (optind + 2 != argc || c.window < 1 || c.timeout < 10 || c.deadline < 0
       || (opt_server && opt_client)
-      || (!(opt_server || opt_client) && opt_unix))
+      || (!(opt_server || opt_client) && opt_unix)
+      || ((opt_server || opt_client) && npaths)
+      || (lo.mux && !(opt_server || opt_client))
+      || lo.sched_budget < 0 || (nrules && !lo.sched_budget)
+      || opt_backends < 0 || (opt_backends && !opt_server)
+      || (opt_file && (opt_server || opt_client)))
     usage ();
   c.timer = c.timeout / 5;
+  if (!rel_loop_new (&c, &lo))
+    usage ();
+  loop->nostderr = 0;		/* the tester may die */
+  if (opt_backends)
+    backend_init (opt_backends);
+  for (opt = 0; opt < nrules; opt++)
+    rel_loop_weight (loop, &rules[opt].addr, rules[opt].weight,
+		     rules[opt].prio);
+  log_start ();
   local = argv[optind];
   remote = argv[optind+1];
 
@@ -1008,6 +2997,13 @@ main (int argc, char **argv)
     c.single_connection = 1;
     cn->rfd = 0;
     cn->wfd = 1;
+    if (opt_file) {
+      if ((cn->rfd = open (opt_file, O_RDONLY)) < 0) {
+	perror (opt_file);
+	exit (1);
+      }
+      conn_mapinput (cn);
+    }
     if (get_address (&sr, 0, 1, AF_INET, remote) < 0
 	|| get_address (&sl, 1, 1, sr.ss_family, local) < 0
 	|| (cn->nfd = listen_on (1, &sl)) < 0)
@@ -1017,16 +3013,34 @@ main (int argc, char **argv)
       exit (1);
     }
     cn->server = 0;
-    cn->peer = sr;
+    conn_setpeer (cn, &sr);
     make_async (cn->rfd);
     make_async (cn->wfd);
     make_async (cn->nfd);
+    for (opt = 0; opt < npaths; opt++) {
+      int fd;
+      char *pr = paths[opt];
+      char *pl = strsep (&pr, ",");
+      if (get_address (&sr, 0, 1, AF_INET, pr) < 0
+	  || get_address (&sl, 1, 1, sr.ss_family, pl) < 0
+	  || (fd = listen_on (1, &sl)) < 0)
+	exit (1);
+      if (connect (fd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
+	perror ("connect");
+	exit (1);
+      }
+      make_async (fd);
+      conn_addpath (cn, fd);
+    }
     cn->rel = rel_create (cn, NULL, &c);
 
     conn_mkevents ();
-    while (conn_list)
+    while (loop->conn_list)
       conn_poll (&c);
+    rel_loop_free (loop);
   }
 
   return 0;
 }
+
+#endif /* !LIBREL */
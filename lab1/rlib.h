@@ -1,9 +1,14 @@
+#ifndef RLIB_H
+#define RLIB_H
+
 #if DMALLOC
 #include <dmalloc.h>
 #endif /* DMALLOC */
 
 #include <stdint.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -185,6 +190,17 @@ struct config_common {
   int timer;			/* How often rel_timer called in milliseconds */
   int timeout;			/* Retransmission timeout in milliseconds */
   int single_connection;        /* Exit after first connection failure */
+  int timestamps;		/* Carry timestamp option (both ends need -T) */
+  int fec;			/* XOR parity packets (both ends need -F) */
+  int compress;			/* LZ compression (both ends need -Z) */
+  int deadline;			/* Message mode (-P): msec a message may be
+				   retransmitted for, 0 = fully reliable */
+  int stats;			/* Print connection statistics at teardown */
+  int autotune;			/* Size window and buffers from the BDP (-A);
+				   window is then the maximum */
+  size_t bufmax;		/* Largest output buffer autotuning asks for */
+  int cookies;			/* Server: admit new peers with a cookie
+				   exchange (both ends need -K) */
 };
 
 typedef struct reliable_state rel_t;
@@ -196,6 +212,13 @@ extern int opt_debug;		/* When != 0, print packets */
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
 uint16_t cksum (const void *_data, int len); /* compute TCP-like checksum */
+/* The same in parts: cksum_add sums len more bytes into a partial sum
+ * (start with 0), cksum_copy copies them to dst as it sums them, and
+ * cksum_fold turns the sum into what goes in the cksum field.  Every
+ * part but the last must have an even length. */
+uint32_t cksum_add (uint32_t sum, const void *data, int len);
+uint32_t cksum_copy (uint32_t sum, void *dst, const void *src, int len);
+uint16_t cksum_fold (uint32_t sum);
 
 
 /* Returns 1 when two addresses equal, 0 otherwise */
@@ -207,6 +230,18 @@ int addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b);
    implementing a hash table. */
 unsigned int addrhash (const struct sockaddr_storage *s);
 
+/* Keyed hash (SipHash-2-4) of an address and a number, under a secret
+   drawn at random for the loop of the calling thread.  With port 0,
+   only the host part of the address counts.  Unlike addrhash, no one
+   who does not know the secret can tell it in advance, so it may
+   serve as a cookie. */
+uint64_t addrmac (const struct sockaddr_storage *ss, int port, uint64_t n);
+
+/* Per-host rate limit: returns 1, and counts one more, if the host of
+   ss has not had rate (per second) yet, else 0.  A second's worth may
+   go at once. */
+int addr_ratelimit (const struct sockaddr_storage *ss, int rate);
+
 /* Actual size of the real socket address structure stashed in a
    sockaddr_storage. */
 size_t addrsize (const struct sockaddr_storage *ss);
@@ -230,6 +265,21 @@ int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
  * to return 0 if you write less than this many bytes. */
 size_t conn_bufspace (conn_t *c);
 
+/* Ask for an output buffer of size bytes instead of the default 8192.
+ * rlib grants at most an equal share of its memory budget for all
+ * connections, so what it grants shrinks as connections are added;
+ * ask again from time to time.  Returns the size granted. */
+size_t conn_setbufsize (conn_t *c, size_t size);
+
+/* Buffers for data you hold on to, such as packets received out of
+ * order.  They come from a pool shared with the output buffers of all
+ * connections, whose total is bounded (-G).  When the pool is tight,
+ * conn_bufalloc returns NULL once the connection holds its fair share,
+ * unless force is set: drop the packet then, and do not acknowledge
+ * it.  Pass conn_buffree the same size you allocated. */
+void *conn_bufalloc (conn_t *c, size_t n, int force);
+void conn_buffree (conn_t *c, void *p, size_t n);
+
 /* Call this function to produce output from the UDP packets you have
  * received.  If you call it with len == 0, then it will send an EOF
  * to the other side.  Returns number of bytes written (>= 0) on
@@ -243,15 +293,93 @@ size_t conn_bufspace (conn_t *c);
  * write. */
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Same as conn_output, but gathers the data from iovcnt buffers, so
+ * that several packets can go out in a single writev.  iovcnt must be
+ * at least 1 and the total length more than 0; use conn_output to send
+ * an EOF. */
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
  * data currently available, and -1 on EOF or error. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* Input from a file (reliable -f) is mapped in memory, and then need
+ * not be copied: conn_inputref works like conn_input, but instead of
+ * copying up to len bytes, points *data at them in the mapping, where
+ * they stay for as long as the connection.  It may only be used when
+ * conn_inputmapped says so.  (The file must not shrink meanwhile.) */
+int conn_inputmapped (conn_t *c);
+int conn_inputref (conn_t *c, const void **data, size_t len);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
+/* Address of the other end of the connection.  Only addrsize () bytes
+ * of it are valid, which is all addreq () and addrhash () look at. */
+const struct sockaddr_storage *conn_peer (conn_t *c);
+
+/* Arrival time (CLOCK_REALTIME) of the packet currently being passed
+ * to rel_recvpkt or rel_demux.  This comes from the kernel
+ * (SO_TIMESTAMPNS) when the platform supports it, so it does not
+ * include time the packet spent queued before we read it. */
+void pkt_rcvtime (struct timespec *ts);
+
+/* Multipath (-m): a connection may stripe its packets over several
+ * UDP sockets, or paths.  conn_sendpkt picks a path for each packet in
+ * proportion to its delivery rate; conn_sendpkt_on sends on a given
+ * path (or lets rlib pick if path is -1).  conn_lastpath tells which
+ * path the last packet went out on, and pkt_rcvpath which path the
+ * packet being passed to rel_recvpkt came in on.  Feed RTT samples
+ * (usec) and losses (rtt < 0) back with conn_pathsample so that rlib
+ * can weigh the paths.  Without -m there is just path 0. */
+int conn_npaths (conn_t *c);
+int conn_sendpkt_on (conn_t *c, int path, const packet_t *pkt, size_t len);
+int conn_lastpath (conn_t *c);
+int pkt_rcvpath (void);
+void conn_pathsample (conn_t *c, int path, long rtt);
+
+/* Multiplexed sessions (-X, client and server): a client carries all
+ * the TCP connections it accepts as streams of one UDP session with
+ * the server.  On the server, every stream of a peer is a connection
+ * of its own, so demultiplex by peer address and stream number:
+ * pkt_rcvstream is the stream of the packet passed to rel_demux, and
+ * conn_create puts the new connection on that stream.  Without -X
+ * both are always 0. */
+uint32_t pkt_rcvstream (void);
+uint32_t conn_stream (conn_t *c);
+
+/* What cksum would give for the first len bytes of the packet being
+ * passed to rel_recvpkt or rel_demux, with its cksum field zeroed.
+ * When rlib had to copy the packet (UDP_GRO), it summed it during the
+ * copy, and this costs no second pass over the payload. */
+uint16_t pkt_rcvcksum (const packet_t *pkt, size_t len);
+
+/* Send a packet back to where the one being passed to rel_demux came
+ * from, on its stream, to answer a peer that has no connection (yet).
+ * The packet goes as it is, checksum and all. */
+int pkt_reply (const packet_t *pkt, size_t len);
+
+/* Fair scheduling (-Q budget): with many connections ready to send,
+ * rlib shares out budget Data packets per conn_poll by deficit round
+ * robin, in proportion to the weight of each connection, and to the
+ * connections of the highest priority first.  Call conn_maysend right
+ * before sending each new Data packet; when it returns 0, stop: rlib
+ * calls rel_read again when the connection's turn comes.  Without -Q
+ * it always returns 1.  conn_setsched sets the weight (default 1) and
+ * priority (0, the default and served first, to SCHED_PRIOS - 1) of a
+ * connection; -W sets them for peers given on the command line. */
+#define SCHED_PRIOS 4
+int conn_maysend (conn_t *c);
+void conn_setsched (conn_t *c, int weight, int prio);
+
+/* Record a packet event (enum trace_event in trace.h) in the binary
+ * trace ring, fields in host byte order.  Cheap enough to call for
+ * every packet. */
+void conn_trace (conn_t *c, int event, uint32_t seqno, uint32_t ackno,
+		 size_t len);
+
 /* Functions you must provide (in reliable.c). */
 
 rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
@@ -269,6 +397,7 @@ void rel_demux (const struct config_common *cc,
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
 void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_stats (void);	/* Invoked on SIGUSR1, print connection statistics */
 
 
 
@@ -304,3 +433,5 @@ int connect_to (int dgram, const struct sockaddr_storage *ss);
 #if NEED_CLOCK_GETTIME
 int clock_gettime (int, struct timespec *);
 #endif /* NEED_CLOCK_GETTIME */
+
+#endif /* RLIB_H */
@@ -0,0 +1,762 @@
+/* Deterministic discrete-event simulator for reliable.c.
+ *
+ * sim links reliable.o against a fake rlib, in which conn_sendpkt
+ * puts packets on a modeled network (delay, jitter, loss, a bottleneck
+ * rate with a drop-tail queue) and conn_input/conn_output are an
+ * endless source and a checking sink.  Time is virtual: reliable.o is
+ * linked with -Wl,--wrap=clock_gettime, so every clock it reads is the
+ * simulation clock, and a run only takes as long as the events in it.
+ *
+ * Each of the -n connections is a pair of peers sending -b bytes to
+ * each other, as two copies of reliable in standalone mode would.  The
+ * same options and seed (-x) always give the same run, so sweeping one
+ * parameter in a shell loop compares like with like.  sim exits 1 if
+ * any connection did not finish, or delivered wrong data.
+ *
+ * With -P, messages the sender gave up on leave gaps in what is
+ * delivered: the sink then looks for the data it got further on in the
+ * stream, and counts what it jumped over as skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+
+#define SIM_EPOCH 1000000000	/* CLOCK_REALTIME seconds at virtual 0 */
+#define NSEC 1000000000ULL
+
+char *progname;
+int opt_debug;
+
+/* Network and application model, set from the command line */
+static uint64_t delay_ns = 10000000;	/* one way */
+static uint64_t jitter_ns;		/* added uniformly in [0, jitter) */
+static double loss;			/* probability a packet is lost */
+static uint64_t rate;			/* bottleneck of each direction of each
+					   connection, bytes/s, 0 = none */
+static size_t queue_bytes;		/* drop-tail queue at the bottleneck */
+static uint64_t drain;			/* sink rate, bytes/s, 0 = instant */
+static uint64_t nbytes = 1 << 20;	/* sent in each direction */
+static int gaps;			/* -P: delivered data may have gaps */
+
+struct conn {
+  rel_t *rel;			/* NULL once reliable destroyed it */
+  struct conn *peer;
+  uint32_t index;		/* which pair */
+  int dir;			/* 0 or 1, which end of the pair */
+
+  uint64_t busy_until;		/* bottleneck toward peer is busy until */
+  uint64_t sent;		/* bytes handed out by conn_input */
+  uint64_t received;		/* bytes taken by conn_output */
+  uint64_t skipped;		/* bytes the sender gave up on (-P) */
+  uint64_t outbuf;		/* of those, not drained yet (-o) */
+  size_t bufsize;
+  uint64_t done;		/* time of conn_destroy */
+
+  unsigned readq : 1;		/* on the rel_read queue */
+  unsigned draining : 1;	/* a drain event is scheduled */
+  unsigned eof : 1;		/* conn_output got EOF */
+  unsigned corrupt : 1;		/* conn_output got wrong bytes */
+};
+
+enum { EV_TIMER, EV_ARRIVE, EV_UNREACH, EV_DRAIN };
+
+struct event {
+  uint64_t time;
+  uint64_t seq;			/* ties are broken in scheduling order */
+  int type;
+  struct conn *c;
+  packet_t *pkt;
+  size_t len;
+};
+
+static struct event *heap;
+static size_t heap_n, heap_size;
+static uint64_t ev_seq;
+
+static uint64_t now;		/* virtual time, ns */
+static uint64_t rng = 1;
+
+static struct conn **readq;
+static size_t readq_n;
+
+static struct conn *conns;
+static uint32_t nconns;		/* ends, two per pair */
+static uint32_t live;		/* ends not destroyed yet */
+
+static struct timespec rcvtime;
+
+static struct {
+  uint64_t sent, lost, queue_drops, delivered, unreachable;
+} net;
+
+int __real_clock_gettime (clockid_t, struct timespec *);
+
+int
+__wrap_clock_gettime (clockid_t clk, struct timespec *ts)
+{
+  uint64_t t = now;
+  if (clk == CLOCK_REALTIME)
+    t += SIM_EPOCH * NSEC;
+  ts->tv_sec = t / NSEC;
+  ts->tv_nsec = t % NSEC;
+  return 0;
+}
+
+/* xorshift64*, so that runs do not depend on the C library */
+static uint64_t
+rand64 (void)
+{
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 2685821657736338717ULL;
+}
+
+static double
+rand_unit (void)
+{
+  return (rand64 () >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* What end c sends is pattern from a different offset for each end,
+ * so that data delivered to the wrong connection or at the wrong place
+ * does not compare equal.  The pattern is stored twice, so any run of
+ * up to PATTERN_SIZE bytes is contiguous. */
+#define PATTERN_SIZE 65521	/* prime, so packets never line up with it */
+static uint8_t pattern[2 * PATTERN_SIZE];
+
+/* With -z, the pattern is words from a small vocabulary rather than
+ * random bytes, so that -Z has something to compress */
+static int text;
+
+static void
+make_pattern (void)
+{
+  static const char *const words[] = {
+    "the", "of", "and", "a", "to", "in", "is", "that", "packet", "window",
+    "sequence", "number", "ack", "timeout", "sender", "receiver", "data",
+    "connection", "buffer", "stream",
+  };
+  uint32_t i = 0;
+  const char *w;
+
+  while (i < PATTERN_SIZE) {
+    if (!text) {
+      pattern[i++] = rand64 ();
+      continue;
+    }
+    for (w = words[rand64 () % (sizeof (words) / sizeof (words[0]))];
+	 *w && i < PATTERN_SIZE; w++)
+      pattern[i++] = *w;
+    if (i < PATTERN_SIZE)
+      pattern[i++] = rand64 () % 8 ? ' ' : '\n';
+  }
+  memcpy (pattern + PATTERN_SIZE, pattern, PATTERN_SIZE);
+}
+
+static inline const uint8_t *
+stream_at (const struct conn *c, uint64_t k)
+{
+  return &pattern[(k + (c->index * 2 + c->dir) * 7919ULL) % PATTERN_SIZE];
+}
+
+static int
+ev_before (const struct event *a, const struct event *b)
+{
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void
+schedule (uint64_t time, int type, struct conn *c, packet_t *pkt, size_t len)
+{
+  size_t i;
+  struct event e = { time, ev_seq++, type, c, pkt, len };
+
+  if (heap_n == heap_size) {
+    heap_size = heap_size ? 2 * heap_size : 1024;
+    heap = realloc (heap, heap_size * sizeof (*heap));
+    if (!heap) {
+      fprintf (stderr, "%s: out of memory\n", progname);
+      exit (2);
+    }
+  }
+  for (i = heap_n++; i > 0 && ev_before (&e, &heap[(i - 1) / 2]);
+       i = (i - 1) / 2)
+    heap[i] = heap[(i - 1) / 2];
+  heap[i] = e;
+}
+
+static struct event
+next_event (void)
+{
+  struct event top = heap[0], last = heap[--heap_n];
+  size_t i = 0, child;
+
+  while ((child = 2 * i + 1) < heap_n) {
+    if (child + 1 < heap_n && ev_before (&heap[child + 1], &heap[child]))
+      child++;
+    if (!ev_before (&heap[child], &last))
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/* The fake rlib */
+
+#if !DMALLOC
+void *
+xmalloc (size_t n)
+{
+  void *p = malloc (n);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	     progname, (int) n);
+    abort ();
+  }
+  return p;
+}
+#endif /* !DMALLOC */
+
+/* Peers are never demultiplexed by address here */
+int
+addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+  return a == b;
+}
+
+unsigned int
+addrhash (const struct sockaddr_storage *ss)
+{
+  return (uintptr_t) ss;
+}
+
+uint64_t
+addrmac (const struct sockaddr_storage *ss, int port, uint64_t n)
+{
+  return (uintptr_t) ss ^ n;
+}
+
+int
+addr_ratelimit (const struct sockaddr_storage *ss, int rate)
+{
+  return 1;
+}
+
+/* Nothing is demultiplexed, so there is no one to reply to */
+int
+pkt_reply (const packet_t *pkt, size_t len)
+{
+  return len;
+}
+
+conn_t *
+conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+{
+  return NULL;
+}
+
+const struct sockaddr_storage *
+conn_peer (conn_t *c)
+{
+  static struct sockaddr_storage ss;
+  return &ss;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  c->rel = NULL;
+  c->done = now;
+  live--;
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  uint64_t depart = now;
+  packet_t *copy;
+
+  net.sent++;
+  if (rand_unit () < loss) {
+    net.lost++;
+    return len;
+  }
+  if (rate) {
+    if (c->busy_until > now) {
+      if ((c->busy_until - now) * rate / NSEC + len > queue_bytes) {
+	net.queue_drops++;
+	return len;
+      }
+      depart = c->busy_until;
+    }
+    depart += len * NSEC / rate;
+    c->busy_until = depart;
+  }
+  if (jitter_ns)
+    depart += rand64 () % jitter_ns;
+
+  copy = xmalloc (sizeof (*copy));
+  memcpy (copy, pkt, len);
+  schedule (depart + delay_ns, EV_ARRIVE, c->peer, copy, len);
+  return len;
+}
+
+int
+conn_sendpkt_on (conn_t *c, int path, const packet_t *pkt, size_t len)
+{
+  return conn_sendpkt (c, pkt, len);
+}
+
+int
+conn_npaths (conn_t *c)
+{
+  return 1;
+}
+
+int
+conn_lastpath (conn_t *c)
+{
+  return 0;
+}
+
+int
+pkt_rcvpath (void)
+{
+  return 0;
+}
+
+void
+conn_pathsample (conn_t *c, int path, long rtt)
+{
+}
+
+void
+conn_trace (conn_t *c, int event, uint32_t seqno, uint32_t ackno,
+	    size_t len)
+{
+}
+
+uint32_t
+pkt_rcvstream (void)
+{
+  return 0;
+}
+
+/* Packets are handed over without a copy here: sum them now */
+uint16_t
+pkt_rcvcksum (const packet_t *pkt, size_t len)
+{
+  uint32_t sum = cksum_add (0, pkt, len);
+  return cksum_fold ((sum & 0xffff) + (sum >> 16) + (uint16_t) ~pkt->cksum);
+}
+
+uint32_t
+conn_stream (conn_t *c)
+{
+  return 0;
+}
+
+/* Every connection has a network of its own here: nothing to share */
+int
+conn_maysend (conn_t *c)
+{
+  return 1;
+}
+
+void
+pkt_rcvtime (struct timespec *ts)
+{
+  *ts = rcvtime;
+}
+
+/* rlib calls rel_read again once conn_input has returned data */
+static void
+want_read (conn_t *c)
+{
+  if (!c->readq) {
+    c->readq = 1;
+    readq[readq_n++] = c;
+  }
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t len)
+{
+  if (c->sent == nbytes)
+    return -1;
+  if (len > nbytes - c->sent)
+    len = nbytes - c->sent;
+  if (len > PATTERN_SIZE)
+    len = PATTERN_SIZE;
+  memcpy (buf, stream_at (c, c->sent), len);
+  c->sent += len;
+  want_read (c);
+  return len;
+}
+
+/* The pattern is not mapped: reliable copies it with conn_input */
+int
+conn_inputmapped (conn_t *c)
+{
+  return 0;
+}
+
+int
+conn_inputref (conn_t *c, const void **data, size_t n)
+{
+  return -1;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  return c->outbuf > c->bufsize ? 0 : c->bufsize - c->outbuf;
+}
+
+size_t
+conn_setbufsize (conn_t *c, size_t size)
+{
+  size_t share = ((size_t) 64 << 20) / (live ? live : 1);
+
+  if (size > share)
+    size = share;
+  if (size < 8192)
+    size = 8192;
+  c->bufsize = size;
+  return size;
+}
+
+/* No memory budget here: every buffer is granted */
+void *
+conn_bufalloc (conn_t *c, size_t n, int force)
+{
+  return xmalloc (n);
+}
+
+void
+conn_buffree (conn_t *c, void *p, size_t n)
+{
+  free (p);
+}
+
+/* Data at stream offset received + skipped is not what was sent
+ * there: with -P, find where it comes from further on */
+static void
+resync (conn_t *c, const void *buf, uint64_t received, size_t len)
+{
+  size_t gap;
+
+  for (gap = 1; gaps && gap < PATTERN_SIZE / 2 && len <= PATTERN_SIZE;
+       gap++)
+    if (!memcmp (buf, stream_at (c->peer, received + c->skipped + gap), len)) {
+      c->skipped += gap;
+      return;
+    }
+  c->corrupt = 1;
+}
+
+int
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+  const struct conn *src = c->peer;
+  size_t space = conn_bufspace (c), n = 0, len;
+  int v;
+
+  for (v = 0; v < iovcnt && n < space; v++) {
+    len = iov[v].iov_len;
+    if (len > space - n)
+      len = space - n;
+    if (len > PATTERN_SIZE
+	|| memcmp (iov[v].iov_base,
+		   stream_at (src, c->received + c->skipped + n), len))
+      resync (c, iov[v].iov_base, c->received + n, len);
+    n += len;
+  }
+  c->received += n;
+  if (drain) {
+    c->outbuf += n;
+    if (c->outbuf && !c->draining) {
+      c->draining = 1;
+      schedule (now + NSEC / 1000, EV_DRAIN, c, NULL, 0);
+    }
+  }
+  return n;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t len)
+{
+  struct iovec iov;
+
+  if (len == 0) {
+    c->eof = 1;
+    /* the last messages may have been given up on too */
+    if (gaps && c->received + c->skipped < nbytes)
+      c->skipped = nbytes - c->received;
+    return 0;
+  }
+  iov.iov_base = (void *) buf;
+  iov.iov_len = len;
+  return conn_outputv (c, &iov, 1);
+}
+
+/* The simulation */
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-TFZzAS] [-w window] [-t timeout] [-M bufmax]\n"
+	   "           [-P deadline] [-n conns] [-b bytes] [-d delay]\n"
+	   "           [-j jitter] [-l loss] [-r rate] [-q queue] [-o drain]\n"
+	   "           [-x seed] [-L limit]\n"
+	   "  delay, jitter, deadline in ms; loss in %%; rate, drain in kB/s;"
+	   " queue in packets;\n"
+	   "  limit in simulated seconds\n", progname);
+  exit (2);
+}
+
+static double
+elapsed (const struct timespec *start)
+{
+  struct timespec ts;
+  __real_clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec - start->tv_sec + (ts.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+run_reads (void)
+{
+  while (readq_n > 0) {
+    conn_t *c = readq[--readq_n];
+    c->readq = 0;
+    if (c->rel)
+      rel_read (c->rel);
+  }
+}
+
+static void
+run (const struct config_common *cc, uint64_t limit)
+{
+  uint32_t i;
+
+  for (i = 0; i < nconns; i++) {
+    conn_t *c = &conns[i];
+    c->rel = rel_create (c, NULL, cc);
+    if (!c->rel) {
+      fprintf (stderr, "%s: rel_create failed\n", progname);
+      exit (2);
+    }
+    want_read (c);
+  }
+  schedule (cc->timer * NSEC / 1000, EV_TIMER, NULL, NULL, 0);
+  run_reads ();
+
+  while (live > 0 && heap_n > 0 && heap[0].time <= limit) {
+    struct event e = next_event ();
+    conn_t *c = e.c;
+    uint64_t n;
+
+    now = e.time;
+    switch (e.type) {
+    case EV_TIMER:
+      rel_timer ();
+      schedule (now + cc->timer * NSEC / 1000, EV_TIMER, NULL, NULL, 0);
+      break;
+    case EV_ARRIVE:
+      if (c->rel) {
+	net.delivered++;
+	rcvtime.tv_sec = SIM_EPOCH + now / NSEC;
+	rcvtime.tv_nsec = now % NSEC;
+	rel_recvpkt (c->rel, e.pkt, e.len);
+      }
+      else {
+	/* The peer has exited: the kernel sends back port unreachable */
+	net.unreachable++;
+	schedule (now + delay_ns, EV_UNREACH, c->peer, NULL, 0);
+      }
+      free (e.pkt);
+      break;
+    case EV_UNREACH:
+      /* rlib gives up on the connection */
+      if (c->rel)
+	rel_destroy (c->rel);
+      break;
+    case EV_DRAIN:
+      n = drain / 1000 ? drain / 1000 : 1;	/* over 1 ms */
+      c->outbuf -= n < c->outbuf ? n : c->outbuf;
+      c->draining = 0;
+      if (c->outbuf) {
+	c->draining = 1;
+	schedule (now + NSEC / 1000, EV_DRAIN, c, NULL, 0);
+      }
+      if (c->rel)
+	rel_output (c->rel);
+      break;
+    }
+    run_reads ();
+  }
+}
+
+static int
+report (const struct config_common *cc, double wall)
+{
+  uint32_t i, completed = 0, corrupt = 0;
+  uint64_t maxdone = 0, skipped = 0;
+  double total = 0;
+
+  for (i = 0; i < nconns; i += 2) {
+    conn_t *a = &conns[i], *b = &conns[i + 1];
+    if (a->corrupt || b->corrupt)
+      corrupt++;
+    skipped += a->skipped + b->skipped;
+    if (!a->rel && !b->rel && a->eof && b->eof
+	&& a->received + a->skipped == nbytes
+	&& b->received + b->skipped == nbytes) {
+      uint64_t done = a->done > b->done ? a->done : b->done;
+      completed++;
+      total += done / 1e9;
+      if (done > maxdone)
+	maxdone = done;
+    }
+  }
+
+  printf ("%u connections, %" PRIu64 " bytes each way, window %d,"
+	  " timeout %d ms\n", nconns / 2, nbytes, cc->window, cc->timeout);
+  printf ("  completed %u, corrupt %u, %.3f s simulated in %.3f s\n",
+	  completed, corrupt, now / 1e9, wall);
+  if (completed)
+    printf ("  completion mean %.3f s, max %.3f s;"
+	    " goodput %.1f kB/s per direction\n",
+	    total / completed, maxdone / 1e9,
+	    nbytes / (total / completed) / 1000);
+  printf ("  packets sent %" PRIu64 ", lost %" PRIu64 ", queue drops %"
+	  PRIu64 ", delivered %" PRIu64 ", unreachable %" PRIu64 "\n",
+	  net.sent, net.lost, net.queue_drops, net.delivered, net.unreachable);
+  if (cc->deadline)
+    printf ("  skipped %" PRIu64 " bytes (%.2f%%)\n", skipped,
+	    100.0 * skipped / nbytes / nconns);
+
+  return completed == nconns / 2 && !corrupt ? 0 : 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct config_common cc;
+  struct timespec start;
+  uint32_t pairs = 1, i;
+  uint32_t queue = 100;
+  double limit = 3600;
+  int opt;
+
+  progname = strrchr (argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  memset (&cc, 0, sizeof (cc));
+  cc.window = 1;
+  cc.timeout = 2000;
+  cc.bufmax = 4 << 20;
+  cc.single_connection = 1;
+
+  while ((opt = getopt (argc, argv, "TFZzASw:t:M:P:n:b:d:j:l:r:q:o:x:L:")) != -1)
+    switch (opt) {
+    case 'T':
+      cc.timestamps = 1;
+      break;
+    case 'F':
+      cc.fec = 1;
+      break;
+    case 'Z':
+      cc.compress = 1;
+      break;
+    case 'z':
+      text = 1;
+      break;
+    case 'A':
+      cc.autotune = 1;
+      break;
+    case 'S':
+      cc.stats = 1;
+      break;
+    case 'w':
+      cc.window = atoi (optarg);
+      break;
+    case 't':
+      cc.timeout = atoi (optarg);
+      break;
+    case 'M':
+      cc.bufmax = atol (optarg);
+      break;
+    case 'P':
+      cc.deadline = atoi (optarg);
+      break;
+    case 'n':
+      pairs = atol (optarg);
+      break;
+    case 'b':
+      nbytes = strtoull (optarg, NULL, 0);
+      break;
+    case 'd':
+      delay_ns = atof (optarg) * 1e6;
+      break;
+    case 'j':
+      jitter_ns = atof (optarg) * 1e6;
+      break;
+    case 'l':
+      loss = atof (optarg) / 100;
+      break;
+    case 'r':
+      rate = atof (optarg) * 1000;
+      break;
+    case 'q':
+      queue = atol (optarg);
+      break;
+    case 'o':
+      drain = atof (optarg) * 1000;
+      break;
+    case 'x':
+      rng = strtoull (optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL | 1;
+      break;
+    case 'L':
+      limit = atof (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || cc.window < 1 || cc.timeout < 10 || pairs < 1
+      || loss < 0 || loss >= 1 || limit <= 0)
+    usage ();
+  cc.timer = cc.timeout / 5;
+  gaps = cc.deadline;
+  queue_bytes = (size_t) queue * sizeof (packet_t);
+
+  nconns = live = 2 * pairs;
+  conns = calloc (nconns, sizeof (*conns));
+  readq = malloc (nconns * sizeof (*readq));
+  if (!conns || !readq) {
+    fprintf (stderr, "%s: out of memory\n", progname);
+    exit (2);
+  }
+  make_pattern ();
+  for (i = 0; i < nconns; i++) {
+    conns[i].index = i / 2;
+    conns[i].dir = i % 2;
+    conns[i].peer = &conns[i ^ 1];
+    conns[i].bufsize = 8192;
+  }
+
+  __real_clock_gettime (CLOCK_MONOTONIC, &start);
+  run (&cc, limit * NSEC);
+  return report (&cc, elapsed (&start));
+}
@@ -0,0 +1,47 @@
+/* Binary packet trace.
+
+   Every process keeps the last TRACE_RING_SIZE packet events in
+   memory, as fixed-size records, at the cost of a clock read and a
+   24-byte store per packet.  The ring is written to a file on SIGUSR2,
+   and at exit when --trace names a file.  tracedump decodes it.
+
+   A trace file is a struct trace_header followed by its count records,
+   oldest first, all in the byte order of the machine that wrote it. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_RING_SIZE  65536	/* records, must be a power of 2 */
+#define TRACE_MAGIC      0x43525452 /* "RTRC" */
+#define TRACE_VERSION    1
+
+enum trace_event {
+  TRACE_SEND,			/* packet handed to the kernel */
+  TRACE_RECV,			/* intact packet passed to the protocol */
+  TRACE_RETRANSMIT,		/* timer expired, the next send is a copy */
+  TRACE_DROP,			/* packet thrown away (corrupt, bad length) */
+  TRACE_NEVENTS
+};
+
+struct trace_record {
+  uint64_t usec;		/* CLOCK_REALTIME, microseconds */
+  uint32_t conn;		/* rlib connection number */
+  uint32_t seqno;		/* 0 for Ack packets */
+  uint32_t ackno;
+  uint16_t len;			/* length field of the packet */
+  uint8_t event;		/* enum trace_event */
+  uint8_t path;			/* multipath path (-m), else 0 */
+};
+
+struct trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;		/* sizeof (struct trace_record) */
+  uint32_t pid;
+  uint32_t count;		/* records that follow */
+  uint64_t lost;		/* older records overwritten in the ring */
+};
+
+#endif /* TRACE_H */
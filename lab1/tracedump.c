@@ -0,0 +1,179 @@
+/* Decode packet traces written by reliable (see trace.h).
+ *
+ *   tracedump [-c conn] file             timeline of all events
+ *   tracedump -s [-c conn] file          sequence diagram per connection
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+static char *progname;
+
+static const char *event_names[TRACE_NEVENTS] = {
+  "send", "recv", "retransmit", "drop",
+};
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: %s [-s] [-c conn] trace-file\n", progname);
+  exit (1);
+}
+
+static struct trace_record *
+load (const char *file, struct trace_header *h)
+{
+  FILE *f = fopen (file, "rb");
+  struct trace_record *t;
+  size_t n;
+
+  if (!f) {
+    perror (file);
+    exit (1);
+  }
+  if (fread (h, sizeof (*h), 1, f) != 1 || h->magic != TRACE_MAGIC) {
+    fprintf (stderr, "%s: not a trace file\n", file);
+    exit (1);
+  }
+  if (h->version != TRACE_VERSION
+      || h->record_size != sizeof (struct trace_record)) {
+    fprintf (stderr, "%s: trace version %d, record size %d not supported\n",
+	     file, h->version, h->record_size);
+    exit (1);
+  }
+
+  t = malloc ((h->count ? h->count : 1) * sizeof (*t));
+  if (!t) {
+    fprintf (stderr, "%s: out of memory\n", progname);
+    exit (1);
+  }
+  n = fread (t, sizeof (*t), h->count, f);
+  if (n != h->count) {
+    fprintf (stderr, "%s: truncated, using the %zu whole records there\n",
+	     file, n);
+    h->count = n;
+  }
+  fclose (f);
+  return t;
+}
+
+static void
+describe (char *buf, size_t size, const struct trace_record *r)
+{
+  if (r->event == TRACE_RETRANSMIT)
+    snprintf (buf, size, "timeout seq %" PRIu32, r->seqno);
+  else if (r->seqno)
+    snprintf (buf, size, "data seq %" PRIu32 " ack %" PRIu32 " (%u)",
+	      r->seqno, r->ackno, r->len);
+  else
+    snprintf (buf, size, "ack %" PRIu32 " (%u)", r->ackno, r->len);
+}
+
+static void
+timeline (const struct trace_record *t, uint32_t n, long conn)
+{
+  uint32_t i;
+  char what[80];
+
+  for (i = 0; i < n; i++) {
+    const struct trace_record *r = &t[i];
+    uint64_t dt = r->usec - t[0].usec;
+    if (conn >= 0 && r->conn != conn)
+      continue;
+    describe (what, sizeof (what), r);
+    printf ("%6" PRIu64 ".%06" PRIu64 "  conn %-4" PRIu32 " %-10s %s",
+	    dt / 1000000, dt % 1000000, r->conn,
+	    r->event < TRACE_NEVENTS ? event_names[r->event] : "?", what);
+    if (r->path)
+      printf (" path %u", r->path);
+    printf ("\n");
+  }
+}
+
+/* Sends go right, receptions come from the right. */
+static void
+diagram (const struct trace_record *t, uint32_t n, uint32_t conn)
+{
+  uint32_t i;
+  char what[80];
+
+  printf ("\nconnection %" PRIu32 "\n", conn);
+  printf ("%13s  %-47s%s\n", "time", "local", "peer");
+  for (i = 0; i < n; i++) {
+    const struct trace_record *r = &t[i];
+    uint64_t dt = r->usec - t[0].usec;
+    if (r->conn != conn)
+      continue;
+    describe (what, sizeof (what), r);
+    printf ("%6" PRIu64 ".%06" PRIu64 "  ", dt / 1000000, dt % 1000000);
+    switch (r->event) {
+    case TRACE_SEND:
+      printf ("%-32s ----------->\n", what);
+      break;
+    case TRACE_RECV:
+      printf ("%-32s <-----------  %s\n", "", what);
+      break;
+    case TRACE_DROP:
+      printf ("%-32s <-----X-----  %s\n", "", what);
+      break;
+    case TRACE_RETRANSMIT:
+      printf ("%s\n", what);
+      break;
+    }
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  struct trace_header h;
+  struct trace_record *t;
+  long conn = -1;
+  int opt_seq = 0;
+  int opt;
+  uint32_t i, j;
+
+  progname = strrchr (argv[0], '/');
+  progname = progname ? progname + 1 : argv[0];
+
+  while ((opt = getopt (argc, argv, "sc:")) != -1)
+    switch (opt) {
+    case 's':
+      opt_seq = 1;
+      break;
+    case 'c':
+      conn = atol (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind + 1 != argc)
+    usage ();
+
+  t = load (argv[optind], &h);
+  printf ("pid %" PRIu32 ", %" PRIu32 " events", h.pid, h.count);
+  if (h.lost)
+    printf (" (%" PRIu64 " older ones overwritten)", h.lost);
+  printf ("\n");
+
+  if (!opt_seq)
+    timeline (t, h.count, conn);
+  else if (conn >= 0)
+    diagram (t, h.count, conn);
+  else
+    /* Every connection, in order of first appearance */
+    for (i = 0; i < h.count; i++) {
+      for (j = 0; j < i && t[j].conn != t[i].conn; j++)
+	;
+      if (j == i)
+	diagram (t, h.count, t[i].conn);
+    }
+
+  free (t);
+  return 0;
+}